@@ -66,15 +66,20 @@ bitmap_getdata(struct bitmap *b)
 	return b->v;
 }
 
-/* return negative value on error */
+/* locates a cleared bit among the nbits bits from start, which are whole
+ * words.
+ * return negative value on error */
 int
-bitmap_alloc(struct bitmap *b, u_int32_t *index)
+bitmap_alloc(struct bitmap *b, u_int32_t start, u_int32_t nbits,
+             u_int32_t *index)
 {
 	u_int32_t ix;
-	u_int32_t maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+	u_int32_t maxix = (start + nbits) / BITS_PER_WORD;
 	u_int32_t offset;
 
-	for (ix=0; ix<maxix; ix++) {
+	assert(start % BITS_PER_WORD == 0 && nbits % BITS_PER_WORD == 0);
+	assert(start + nbits <= b->nbits);
+	for (ix=start/BITS_PER_WORD; ix<maxix; ix++) {
 		if (b->v[ix]!=WORD_ALLBITS) {
 			for (offset = 0; offset < BITS_PER_WORD; offset++) {
 				WORD_TYPE mask = ((WORD_TYPE)1)<<offset;
@@ -91,6 +96,34 @@ bitmap_alloc(struct bitmap *b, u_int32_t *index)
 	return -ENOSPC;
 }
 
+/* locates nr consecutive cleared bits among the nbits bits from start.
+ * return negative value on error */
+int
+bitmap_alloc_range(struct bitmap *b, u_int32_t start, u_int32_t nbits,
+                   u_int32_t nr, u_int32_t *index)
+{
+	u_int32_t first = 0, len = 0;
+	u_int32_t i;
+
+	assert(nr > 0);
+	assert(start + nbits <= b->nbits);
+	for (i = start; i < start + nbits; i++) {
+		if (bitmap_isset(b, i)) {
+			len = 0;
+			continue;
+		}
+		if (len++ == 0)
+			first = i;
+		if (len == nr) {
+			for (i = first; i < first + nr; i++)
+				bitmap_mark(b, i);
+			*index = first;
+			return 0;
+		}
+	}
+	return -ENOSPC;
+}
+
 static inline void
 bitmap_translate(u_int32_t bitno, u_int32_t *ix, WORD_TYPE *mask)
 {
@@ -164,13 +197,48 @@ bitmap_equal(struct bitmap *a, struct bitmap *b)
 int
 bitmap_nr_allocated(struct bitmap *b)
 {
-        int i;
+        u_int32_t ix;
+        u_int32_t maxix = b->nbits / BITS_PER_WORD;
+        u_int32_t i;
         int nr = 0;
 
-        for (i = 0; i < b->nbits; i++) {
+        /* whole words at a time, then the leftover bits */
+        for (ix = 0; ix < maxix; ix++) {
+                nr += __builtin_popcount(b->v[ix]);
+        }
+        for (i = maxix * BITS_PER_WORD; i < b->nbits; i++) {
                 if (bitmap_isset(b, i))
                         nr++;
         }
         return nr;
 }
 
+/* counts the set bits among the nbits bits from start, which are whole
+ * words */
+int
+bitmap_nr_allocated_range(struct bitmap *b, u_int32_t start, u_int32_t nbits)
+{
+        u_int32_t ix;
+        u_int32_t maxix = (start + nbits) / BITS_PER_WORD;
+        int nr = 0;
+
+        assert(start % BITS_PER_WORD == 0 && nbits % BITS_PER_WORD == 0);
+        assert(start + nbits <= b->nbits);
+        for (ix = start / BITS_PER_WORD; ix < maxix; ix++) {
+                nr += __builtin_popcount(b->v[ix]);
+        }
+        return nr;
+}
+
+void
+bitmap_merge(struct bitmap *dst, struct bitmap *src)
+{
+	u_int32_t ix;
+	u_int32_t maxix;
+
+        assert(dst->nbits == src->nbits);
+        maxix = DIVROUNDUP(src->nbits, BITS_PER_WORD);
+	for (ix=0; ix<maxix; ix++) {
+                dst->v[ix] |= src->v[ix];
+        }
+}
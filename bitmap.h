@@ -8,11 +8,17 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
- *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc   - locate a cleared bit in a range of bits, set it, and
+ *                      return its index.
+ *     bitmap_alloc_range - locate nr consecutive cleared bits in a range of
+ *                      bits, set them, and return the index of the first
+ *                      one.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
+ *     bitmap_nr_allocated_range - count the set bits in a range of bits.
+ *     bitmap_merge   - set the bits of one bitmap that are set in another.
  */
 
 #include <sys/types.h>
@@ -26,13 +32,20 @@ struct bitmap;  /* Opaque. */
 
 int            bitmap_create(u_int32_t nbits, struct bitmap **bp);
 void          *bitmap_getdata(struct bitmap *);
-int            bitmap_alloc(struct bitmap *, u_int32_t *index);
+int            bitmap_alloc(struct bitmap *, u_int32_t start, 
+                            u_int32_t nbits, u_int32_t *index);
+int            bitmap_alloc_range(struct bitmap *, u_int32_t start,
+                                  u_int32_t nbits, u_int32_t nr, 
+                                  u_int32_t *index);
 void           bitmap_mark(struct bitmap *, u_int32_t index);
 void           bitmap_unmark(struct bitmap *, u_int32_t index);
 int	       bitmap_isset(struct bitmap *, u_int32_t index);
 void           bitmap_destroy(struct bitmap *);
 int            bitmap_equal(struct bitmap *, struct bitmap *);
 int            bitmap_nr_allocated(struct bitmap *);
+int            bitmap_nr_allocated_range(struct bitmap *, u_int32_t start,
+                                         u_int32_t nbits);
+void           bitmap_merge(struct bitmap *dst, struct bitmap *src);
 
 #endif /* _BITMAP_H_ */
 
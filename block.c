@@ -1,53 +1,92 @@
+#include <fcntl.h>
 #include "testfs.h"
 #include "block.h"
+#include "journal.h"
 
-static char zero[BLOCK_SIZE] = {0};
+#define ZERO_BLOCKS 64
 
+static char zero[ZERO_BLOCKS * BLOCK_SIZE] = {0};
+
+/* writes blocks to the image, bypassing the journal. the blocks are
+ * written at their offset, so that threads can do I/O concurrently. */
 void
-write_blocks(struct super_block *sb, char *blocks, int start, int nr)
+dev_write_blocks(struct super_block *sb, char *blocks, int start, int nr)
 {
-        long pos;
-       
-        if ((pos = ftell(sb->dev)) < 0) {
-                EXIT("ftell");
-        }
-        if (fseek(sb->dev, start * BLOCK_SIZE, SEEK_SET) < 0) {
-                EXIT("fseek");
-        }
-        if (fwrite(blocks, BLOCK_SIZE, nr, sb->dev) != nr) {
-                EXIT("fwrite");
-        }
-        if (fseek(sb->dev, pos, SEEK_SET) < 0) {
-                EXIT("fseek");
+        if (pwrite(fileno(sb->dev), blocks, nr * BLOCK_SIZE, 
+                   (off_t)start * BLOCK_SIZE) != nr * BLOCK_SIZE) {
+                EXIT("pwrite");
         }
 }
 
+/* writes blocks, which are logged by the journal instead while a
+ * transaction is running */
+void
+write_blocks(struct super_block *sb, char *blocks, int start, int nr)
+{
+        if (sb->journal && testfs_journal_write(sb, blocks, start, nr))
+                return;
+        dev_write_blocks(sb, blocks, start, nr);
+}
+
+/* writes blocks of file data, which the journal may write in place even
+ * while a transaction is running */
+void
+write_data_blocks(struct super_block *sb, char *blocks, int start, int nr)
+{
+        if (sb->journal)
+                testfs_journal_write_data(sb, blocks, start, nr);
+        else
+                dev_write_blocks(sb, blocks, start, nr);
+}
+
 void
 zero_blocks(struct super_block *sb, int start, int nr)
 {
         int i;
 
-        for (i = 0; i < nr; i++) {
-                write_blocks(sb, zero, start + i, 1);
+        for (i = 0; i < nr; i += ZERO_BLOCKS) {
+                write_blocks(sb, zero, start + i, MIN(nr - i, ZERO_BLOCKS));
         }
 }
 
+/* reads blocks from the image, bypassing the journal */
 void
-read_blocks(struct super_block *sb, char *blocks, int start, int nr)
+dev_read_blocks(struct super_block *sb, char *blocks, int start, int nr)
 {
-        long pos;
+        ssize_t ret;
 
-        if ((pos = ftell(sb->dev)) < 0) {
-                EXIT("ftell");
-        }
-        if (fseek(sb->dev, start * BLOCK_SIZE, SEEK_SET) < 0) {
-                EXIT("fseek");
+        ret = pread(fileno(sb->dev), blocks, nr * BLOCK_SIZE, 
+                    (off_t)start * BLOCK_SIZE);
+        if (ret < 0) {
+                EXIT("pread");
         }
-        if (fread(blocks, BLOCK_SIZE, nr, sb->dev) != nr) {
-                EXIT("freed");
+        /* blocks past the end of the image have not been written in place
+         * yet */
+        bzero(blocks + ret, nr * BLOCK_SIZE - ret);
+}
+
+/* reads blocks, including the versions that the journal has not written
+ * in place yet. the read is retried if the journal wrote blocks in place
+ * and forgot them while it ran. */
+void
+read_blocks(struct super_block *sb, char *blocks, int start, int nr)
+{
+        int gen;
+
+        if (!sb->journal) {
+                dev_read_blocks(sb, blocks, start, nr);
+                return;
         }
-        if (fseek(sb->dev, pos, SEEK_SET) < 0) {
-                EXIT("fseek");
-        }       
+        do {
+                gen = testfs_journal_read_begin(sb);
+                dev_read_blocks(sb, blocks, start, nr);
+        } while (!testfs_journal_read(sb, blocks, start, nr, gen));
 }
 
+/* start reading blocks into the page cache, without waiting for them */
+void
+prefetch_blocks(struct super_block *sb, int start, int nr)
+{
+        posix_fadvise(fileno(sb->dev), (off_t)start * BLOCK_SIZE, 
+                      (off_t)nr * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
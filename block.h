@@ -2,9 +2,14 @@
 #define _BLOCK_H
 #include "super.h"
 
+void dev_write_blocks(struct super_block *sb, char *blocks, int start, int nr);
+void dev_read_blocks(struct super_block *sb, char *blocks, int start, int nr);
 void write_blocks(struct super_block *sb, char *blocks, int start, int nr);
+void write_data_blocks(struct super_block *sb, char *blocks, int start, 
+                       int nr);
 void zero_blocks(struct super_block *sb, int start, int nr);
 void read_blocks(struct super_block *sb, char *blocks, int start, int nr);
+void prefetch_blocks(struct super_block *sb, int start, int nr);
 
 #endif /* _BLOCK_H */
 
@@ -13,12 +13,18 @@ testfs_get_csum(struct super_block *sb, int block_nr)
         assert(sb->csum_table);
         
         if ( block_nr < MAX_NR_CSUMS ) {
-                return sb->csum_table[block_nr];
+                int csum;
+
+                pthread_mutex_lock(&sb->csum_lock);
+                csum = sb->csum_table[block_nr];
+                pthread_mutex_unlock(&sb->csum_lock);
+                return csum;
         }
         
         return 0;
 }
 
+/* called with sb->csum_lock held */
 static void
 testfs_write_csum(struct super_block *sb, int block_nr)
 {
@@ -38,8 +44,37 @@ testfs_put_csum(struct super_block *sb, int phy_block_nr, int csum)
         assert(sb->csum_table);
         
         assert(block_nr >= 0 && block_nr < MAX_NR_CSUMS);
+        pthread_mutex_lock(&sb->csum_lock);
         sb->csum_table[block_nr] = csum;
         testfs_write_csum(sb, block_nr);
+        pthread_mutex_unlock(&sb->csum_lock);
+}
+
+/* calculate and store the checksums of nr contiguous blocks starting at
+ * phy_block_nr, writing each affected checksum table block once */
+void
+testfs_put_csums(struct super_block *sb, int phy_block_nr, const char *blocks,
+                 int nr)
+{
+        int block_nr = phy_block_nr - sb->sb.data_blocks_start;
+        int i, prev = -1;
+
+        assert(sb->csum_table);
+        assert(block_nr >= 0 && block_nr + nr <= MAX_NR_CSUMS);
+        pthread_mutex_lock(&sb->csum_lock);
+        for (i = 0; i < nr; i++) {
+                sb->csum_table[block_nr + i] = 
+                        testfs_calculate_csum(blocks + i * BLOCK_SIZE, 
+                                              BLOCK_SIZE);
+        }
+        for (i = 0; i < nr; i++) {
+                int nr_csum_block = (block_nr + i) * sizeof(int) / BLOCK_SIZE;
+                if (nr_csum_block == prev)
+                        continue;
+                testfs_write_csum(sb, block_nr + i);
+                prev = nr_csum_block;
+        }
+        pthread_mutex_unlock(&sb->csum_lock);
 }
 
 /* could use other algorithm if you want */
@@ -71,7 +106,7 @@ testfs_verify_csum(struct super_block *sb, int phy_block_nr)
         read_blocks(sb, block, phy_block_nr, 1);
         csum = testfs_calculate_csum(block, sizeof(block));
         
-        if (csum != sb->csum_table[block_nr]) {
+        if (csum != testfs_get_csum(sb, block_nr)) {
                 printf("checksum error at block %d\n", phy_block_nr);
                 return -EINVAL;
         }
@@ -11,6 +11,8 @@ struct super_block;
 
 int testfs_get_csum(struct super_block *sb, int block_nr);
 void testfs_put_csum(struct super_block *sb, int block_nr, int csum);
+void testfs_put_csums(struct super_block *sb, int block_nr, const char *blocks,
+                      int nr);
 int testfs_calculate_csum(const char * buf, const int size);
 int testfs_verify_csum(struct super_block *sb, int block_nr);
 
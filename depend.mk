@@ -0,0 +1,26 @@
+testfs.o: testfs.c testfs.h common.h super.h list.h tx.h bitmap.h inode.h \
+ dir.h discard.h journal.h
+mktestfs.o: mktestfs.c testfs.h common.h super.h list.h tx.h bitmap.h \
+ inode.h dir.h journal.h
+stresstestfs.o: stresstestfs.c testfs.h common.h super.h list.h tx.h \
+ bitmap.h inode.h dir.h journal.h
+bitmap.o: bitmap.c bitmap.h testfs.h common.h
+block.o: block.c testfs.h common.h block.h super.h list.h tx.h bitmap.h \
+ journal.h
+super.o: super.c testfs.h common.h super.h list.h tx.h bitmap.h inode.h \
+ dir.h block.h csum.h discard.h walk.h journal.h rcu.h
+inode.o: inode.c testfs.h common.h super.h list.h tx.h bitmap.h block.h \
+ inode.h rcu.h csum.h dir.h
+dir.o: dir.c testfs.h common.h super.h list.h tx.h bitmap.h inode.h \
+ block.h dir.h rcu.h walk.h
+file.o: file.c testfs.h common.h inode.h list.h bitmap.h dir.h tx.h
+tx.o: tx.c super.h list.h tx.h bitmap.h journal.h testfs.h common.h
+csum.o: csum.c csum.h testfs.h common.h super.h list.h tx.h bitmap.h \
+ block.h
+discard.o: discard.c testfs.h common.h super.h list.h tx.h bitmap.h \
+ discard.h
+walk.o: walk.c testfs.h common.h super.h list.h tx.h bitmap.h inode.h \
+ walk.h
+journal.o: journal.c testfs.h common.h super.h list.h tx.h bitmap.h \
+ block.h csum.h discard.h journal.h
+rcu.o: rcu.c testfs.h common.h rcu.h list.h
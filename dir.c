@@ -1,38 +1,400 @@
+#include <stdint.h>
 #include "testfs.h"
 #include "super.h"
 #include "inode.h"
 #include "block.h"
 #include "dir.h"
 #include "tx.h"
+#include "list.h"
+#include "rcu.h"
+#include "walk.h"
 
-/* reads next dirent, updates offset to next dirent in directory */
-/* allocates memory, caller should free */
-struct dirent *
-testfs_next_dirent(struct inode *dir, int *offset)
+/* directories of at least DIR_INDEX_MIN_SIZE bytes are indexed in memory
+ * by a hash of their names, while their inode is cached. smaller ones are
+ * scanned. */
+#define DIR_INDEX_MIN_SIZE (4 * BLOCK_SIZE)
+#define DIR_INDEX_SHIFT 6
+
+struct dir_index_entry {
+        struct hlist_node hnode;
+        int d_offset;
+        int d_inode_nr;
+        char d_name[];
+};
+
+/* a dead dirent that can be reused */
+struct dir_slot {
+        struct list_head list;
+        int d_offset;
+        int d_name_len;
+};
+
+struct dir_index {
+        struct hlist_head table[1 << DIR_INDEX_SHIFT];
+        struct list_head slots;
+        int dead;                       /* bytes in dead dirents */
+};
+
+#define DIRENT_LEN(d) (sizeof(struct dirent) + (d)->d_name_len)
+
+/* the dentry cache remembers the result of name lookups, keyed by
+ * directory and name. a negative entry records that the name does not
+ * exist. each super block has its own cache, changed with sb->dcache_lock
+ * held. entries are added and changed with their directory locked, so
+ * that they agree with it.
+ *
+ * lookups take no lock, and walk the table in an rcu read section. a hit
+ * only marks the entry referenced, if it is not marked already, so that
+ * hot entries are not written. when the cache is full, entries are
+ * evicted from the old end of the lru list, and referenced ones get a
+ * second chance at the new end instead. */
+#define DCACHE_SHIFT 8
+#define DCACHE_MAX_ENTRIES 1024
+
+struct dentry {
+        struct hlist_node hnode;
+        struct list_head lru;
+        struct rcu_head rcu;
+        struct super_block *sb;
+        int dir_nr;
+        int inode_nr;                   /* negative if name does not exist */
+        int referenced;                 /* found since it was last evicted */
+        char name[];
+};
+
+#define dcache_hashfn(dir_nr, name)     \
+        hash_int(hash_str(name, 32) ^ (unsigned int)(dir_nr), DCACHE_SHIFT)
+
+void
+dcache_init(struct super_block *sb)
 {
-        int ret;
-        struct dirent d, *dp;
+        int i;
+
+        sb->dcache_table = malloc((1 << DCACHE_SHIFT) * 
+                                  sizeof(struct hlist_head));
+        if (!sb->dcache_table) {
+                EXIT("malloc");
+        }
+        for (i = 0; i < (1 << DCACHE_SHIFT); i++) {
+                INIT_HLIST_HEAD(&sb->dcache_table[i]);
+        }
+        INIT_LIST_HEAD(&sb->dcache_lru);
+        sb->dcache_nr = 0;
+}
+
+/* called with sb->dcache_lock held. the entry is freed by rcu_reclaim
+ * once the lock is dropped. */
+static void
+dcache_remove(struct dentry *de)
+{
+        hlist_del_rcu(&de->hnode);
+        list_del(&de->lru);
+        de->sb->dcache_nr--;
+        rcu_free(&de->rcu, de);
+}
+
+void
+dcache_destroy(struct super_block *sb)
+{
+        struct dentry *de, *n;
+
+        assert(sb->dcache_table);
+        list_for_each_entry_safe(de, n, &sb->dcache_lru, lru) {
+                dcache_remove(de);
+        }
+        free(sb->dcache_table);
+        sb->dcache_table = NULL;
+}
+
+/* called with sb->dcache_lock held, or in an rcu read section */
+static struct dentry *
+dcache_lookup(struct super_block *sb, int dir_nr, const char *name)
+{
+        struct hlist_node *elem;
+        struct dentry *de;
+
+        hlist_for_each_entry_rcu(de, elem, 
+                                 &sb->dcache_table[dcache_hashfn(dir_nr, 
+                                                                 name)],
+                                 hnode) {
+                if ((de->dir_nr == dir_nr) && (strcmp(de->name, name) == 0))
+                        return de;
+        }
+        return NULL;
+}
+
+/* returns 1 and sets *inode_nrp if name in directory dir_nr is cached,
+ * and 0 otherwise */
+static int
+dcache_find_nr(struct super_block *sb, int dir_nr, const char *name,
+               int *inode_nrp)
+{
+        struct dentry *de;
 
+        rcu_read_lock();
+        if ((de = dcache_lookup(sb, dir_nr, name))) {
+                *inode_nrp = __atomic_load_n(&de->inode_nr, __ATOMIC_RELAXED);
+                if (!__atomic_load_n(&de->referenced, __ATOMIC_RELAXED))
+                        __atomic_store_n(&de->referenced, 1, __ATOMIC_RELAXED);
+        }
+        rcu_read_unlock();
+        return de != NULL;
+}
+
+static int
+dcache_find(struct inode *dir, const char *name, int *inode_nrp)
+{
+        return dcache_find_nr(testfs_inode_get_sb(dir), 
+                              testfs_inode_get_nr(dir), name, inode_nrp);
+}
+
+/* record that name in dir refers to inode_nr, or does not exist when
+ * inode_nr is negative */
+static void
+dcache_insert(struct inode *dir, const char *name, int inode_nr)
+{
+        struct super_block *sb = testfs_inode_get_sb(dir);
+        int dir_nr = testfs_inode_get_nr(dir);
+        struct dentry *de;
+
+        pthread_mutex_lock(&sb->dcache_lock);
+        if ((de = dcache_lookup(sb, dir_nr, name))) {
+                __atomic_store_n(&de->inode_nr, inode_nr, __ATOMIC_RELAXED);
+                goto out;
+        }
+        while (sb->dcache_nr == DCACHE_MAX_ENTRIES) {
+                de = list_entry(sb->dcache_lru.prev, struct dentry, lru);
+                if (!__atomic_exchange_n(&de->referenced, 0, 
+                                         __ATOMIC_RELAXED)) {
+                        dcache_remove(de);
+                        break;
+                }
+                list_del(&de->lru);
+                list_add(&de->lru, &sb->dcache_lru);
+        }
+        if ((de = malloc(sizeof(struct dentry) + strlen(name) + 1)) == NULL)
+                goto out;
+        de->sb = sb;
+        de->dir_nr = dir_nr;
+        de->inode_nr = inode_nr;
+        de->referenced = 0;
+        strcpy(de->name, name);
+        hlist_add_head_rcu(&de->hnode, 
+                           &sb->dcache_table[dcache_hashfn(dir_nr, name)]);
+        list_add(&de->lru, &sb->dcache_lru);
+        sb->dcache_nr++;
+out:
+        pthread_mutex_unlock(&sb->dcache_lock);
+        rcu_reclaim();
+}
+
+/* forget all names in directory dir_nr, which is being removed */
+void
+dcache_purge(struct super_block *sb, int dir_nr)
+{
+        struct dentry *de, *n;
+
+        pthread_mutex_lock(&sb->dcache_lock);
+        list_for_each_entry_safe(de, n, &sb->dcache_lru, lru) {
+                if (de->dir_nr == dir_nr)
+                        dcache_remove(de);
+        }
+        pthread_mutex_unlock(&sb->dcache_lock);
+        rcu_reclaim();
+}
+
+void
+testfs_dirent_iter_init(struct dirent_iter *it, struct inode *dir)
+{
         assert(dir);
         assert(testfs_inode_get_type(dir) == I_DIR);
-        if (*offset >= testfs_inode_get_size(dir))
+        it->dir = dir;
+        it->offset = 0;
+        it->d_offset = 0;
+        it->window = NULL;
+        it->w_start = 0;
+        it->w_len = 0;
+        it->spill = NULL;
+        it->spill_size = 0;
+        it->error = 0;
+}
+
+/* returns the next dirent, or NULL at the end of the directory or on
+ * error, which sets it->error. the dirent points into the directory data,
+ * and is valid until the next call or until the directory is modified.
+ * only a dirent that spans a block boundary, or that is not aligned in
+ * the block, is copied. */
+struct dirent *
+testfs_dirent_iter_next(struct dirent_iter *it)
+{
+        struct dirent d;
+        char *p;
+        int len, reclen, ret;
+
+        if (it->error < 0 || it->offset >= testfs_inode_get_size(it->dir))
                 return NULL;
-        ret = testfs_read_data(dir, *offset, (char *)&d, sizeof(struct dirent));
-        if (ret < 0)
+        if (it->offset < it->w_start || 
+            it->offset >= it->w_start + it->w_len) {
+                it->window = testfs_map_data(it->dir, it->offset, it->block, 
+                                             &it->w_len);
+                if (!it->window) {
+                        it->error = -EIO;
+                        return NULL;
+                }
+                it->w_start = it->offset;
+        }
+        it->d_offset = it->offset;
+        p = it->window + (it->offset - it->w_start);
+        len = it->w_start + it->w_len - it->offset;
+        if (len >= sizeof(struct dirent)) {
+                memcpy(&d, p, sizeof(struct dirent));
+        } else if ((ret = testfs_read_data(it->dir, it->offset, (char *)&d,
+                                           sizeof(struct dirent))) < 0) {
+                it->error = ret;
                 return NULL;
+        }
         assert(d.d_name_len > 0);
-        dp = malloc(sizeof(struct dirent) + d.d_name_len);
-        if (!dp)
+        reclen = sizeof(struct dirent) + d.d_name_len;
+        it->offset += reclen;
+        if (len >= reclen &&
+            (uintptr_t)p % __alignof__(struct dirent) == 0)
+                return (struct dirent *)p;
+        if (it->spill_size < reclen) {
+                char *spill = realloc(it->spill, reclen);
+                if (!spill) {
+                        it->error = -ENOMEM;
+                        return NULL;
+                }
+                it->spill = spill;
+                it->spill_size = reclen;
+        }
+        if (len >= reclen)
+                memcpy(it->spill, p, reclen);
+        else if ((ret = testfs_read_data(it->dir, it->d_offset, it->spill,
+                                         reclen)) < 0) {
+                it->error = ret;
                 return NULL;
-        *dp = d;
-        *offset += sizeof(struct dirent);
-        ret = testfs_read_data(dir, *offset, D_NAME(dp), d.d_name_len);
-        if (ret < 0) {
-                free(dp);
+        }
+        return (struct dirent *)it->spill;
+}
+
+void
+testfs_dirent_iter_destroy(struct dirent_iter *it)
+{
+        free(it->spill);
+        it->spill = NULL;
+}
+
+void
+testfs_dir_index_free(struct dir_index *index)
+{
+        struct dir_index_entry *e;
+        struct hlist_node *elem, *n;
+        struct dir_slot *slot, *next;
+        int i;
+
+        for (i = 0; i < (1 << DIR_INDEX_SHIFT); i++) {
+                hlist_for_each_entry_safe(e, elem, n, &index->table[i], hnode) {
+                        free(e);
+                }
+        }
+        list_for_each_entry_safe(slot, next, &index->slots, list) {
+                free(slot);
+        }
+        free(index);
+}
+
+static struct dir_index_entry *
+testfs_dir_index_find(struct dir_index *index, const char *name)
+{
+        struct dir_index_entry *e;
+        struct hlist_node *elem;
+
+        hlist_for_each_entry(e, elem, 
+                &index->table[hash_str(name, DIR_INDEX_SHIFT)], hnode) {
+                if (strcmp(e->d_name, name) == 0)
+                        return e;
+        }
+        return NULL;
+}
+
+/* returns negative value on error */
+static int
+testfs_dir_index_insert(struct dir_index *index, const char *name, 
+                        int inode_nr, int offset)
+{
+        struct dir_index_entry *e;
+
+        e = malloc(sizeof(struct dir_index_entry) + strlen(name) + 1);
+        if (!e)
+                return -ENOMEM;
+        e->d_offset = offset;
+        e->d_inode_nr = inode_nr;
+        strcpy(e->d_name, name);
+        hlist_add_head(&e->hnode, 
+                       &index->table[hash_str(name, DIR_INDEX_SHIFT)]);
+        return 0;
+}
+
+/* returns negative value on error */
+static int
+testfs_dir_index_add_slot(struct dir_index *index, int offset, int name_len)
+{
+        struct dir_slot *slot = malloc(sizeof(struct dir_slot));
+
+        if (!slot)
+                return -ENOMEM;
+        slot->d_offset = offset;
+        slot->d_name_len = name_len;
+        list_add_tail(&slot->list, &index->slots);
+        index->dead += sizeof(struct dirent) + name_len;
+        return 0;
+}
+
+/* stop indexing dir, e.g., when the index could not be updated */
+static void
+testfs_dir_index_drop(struct inode *dir)
+{
+        testfs_dir_index_free(testfs_inode_get_dir_index(dir));
+        testfs_inode_set_dir_index(dir, NULL);
+}
+
+/* returns the index of dir, building it if dir is large enough.
+ * returns NULL if dir is not indexed. */
+static struct dir_index *
+testfs_dir_index_get(struct inode *dir)
+{
+        struct dir_index *index = testfs_inode_get_dir_index(dir);
+        struct dirent_iter it;
+        struct dirent *d;
+        int i, ret = 0;
+
+        if (index || testfs_inode_get_size(dir) < DIR_INDEX_MIN_SIZE)
+                return index;
+        if ((index = malloc(sizeof(struct dir_index))) == NULL)
                 return NULL;
+        for (i = 0; i < (1 << DIR_INDEX_SHIFT); i++) {
+                INIT_HLIST_HEAD(&index->table[i]);
         }
-        *offset += d.d_name_len;
-        return dp;
+        INIT_LIST_HEAD(&index->slots);
+        index->dead = 0;
+        testfs_dirent_iter_init(&it, dir);
+        while (ret == 0 && (d = testfs_dirent_iter_next(&it))) {
+                if (d->d_inode_nr < 0)
+                        ret = testfs_dir_index_add_slot(index, it.d_offset, 
+                                                        d->d_name_len);
+                else
+                        ret = testfs_dir_index_insert(index, D_NAME(d), 
+                                                      d->d_inode_nr, 
+                                                      it.d_offset);
+        }
+        testfs_dirent_iter_destroy(&it);
+        if (ret < 0 || it.error < 0) {
+                testfs_dir_index_free(index);
+                return NULL;
+        }
+        testfs_inode_set_dir_index(dir, index);
+        return index;
 }
 
 /* returns dirent associated with inode_nr in dir.
@@ -41,127 +403,311 @@ testfs_next_dirent(struct inode *dir, int *offset)
 static struct dirent *
 testfs_find_dirent(struct inode *dir, int inode_nr)
 {
-        struct dirent *d;
-        int offset = 0;
+        struct dirent_iter it;
+        struct dirent *d, *dp = NULL;
 
-        assert(dir);
-        assert(testfs_inode_get_type(dir) == I_DIR);
         assert(inode_nr >= 0);
-        for (; (d = testfs_next_dirent(dir, &offset)); free(d)) {
-                if (d->d_inode_nr == inode_nr)
-                        return d;
+        testfs_dirent_iter_init(&it, dir);
+        while ((d = testfs_dirent_iter_next(&it))) {
+                if (d->d_inode_nr != inode_nr)
+                        continue;
+                dp = malloc(sizeof(struct dirent) + d->d_name_len);
+                if (dp)
+                        memcpy(dp, d, sizeof(struct dirent) + d->d_name_len);
+                break;
         }
-        return NULL;
+        testfs_dirent_iter_destroy(&it);
+        return dp;
 }
 
-/* return 0 on success.
+/* returns the name length that a new dirent with a name of len bytes
+ * takes up in a dead dirent with a name of slot_len bytes, or 0 if it does
+ * not fit. the rest of the dead dirent is split off if it can hold a dirent
+ * of its own, otherwise it pads the new name. */
+static int
+testfs_dirent_fit(int len, int slot_len)
+{
+        if (len == slot_len || slot_len - len > (int)sizeof(struct dirent))
+                return len;
+        if (slot_len > len)
+                return slot_len;
+        return 0;
+}
+
+/* writes a dirent with a name of len bytes, padded with zeros, at offset.
+ * when rest is not zero, it is followed by a dead dirent with a name of
+ * rest bytes, the remainder of the slot that the dirent was placed in.
+ * return 0 on success.
  * return negative value on error. */
 static int
 testfs_write_dirent(struct inode *dir, char *name, int len, int inode_nr,
-                    int offset)
+                    inode_type type, int offset, int rest)
 {
+        struct super_block *sb = testfs_inode_get_sb(dir);
         int ret;
-        struct dirent *d = malloc(sizeof(struct dirent) + len);
+        int size = sizeof(struct dirent) + len;
+        struct dirent *d;
         
+        assert(inode_nr >= 0);
+        assert(len > strlen(name));
+        d = calloc(1, size + (rest ? sizeof(struct dirent) : 0));
         if (!d)
                 return -ENOMEM;
-        assert(inode_nr >= 0);
         d->d_name_len = len;
+        /* older images are read by code that knows no types */
+        d->d_type = (sb->sb.version >= TESTFS_VERSION_DTYPE) ? type : I_NONE;
         d->d_inode_nr = inode_nr;
         strcpy(D_NAME(d), name);
-        ret = testfs_write_data(dir, offset, (char *)d, 
-                                sizeof(struct dirent) + len);
+        if (rest) {
+                struct dirent dead = { rest, I_NONE, -1 };
+                memcpy((char *)d + size, &dead, sizeof(struct dirent));
+                size += sizeof(struct dirent);
+        }
+        ret = testfs_write_data(dir, offset, (char *)d, size);
         free(d);
         return ret;
 }
 
+/* testfs_add_dirent for an indexed directory */
+static int
+testfs_add_dirent_indexed(struct inode *dir, struct dir_index *index, 
+                          char *name, int inode_nr, inode_type type)
+{
+        struct dir_slot *slot, *found = NULL;
+        int len = strlen(name) + 1;
+        int offset = testfs_inode_get_size(dir);
+        int rest = 0;
+        int ret;
+
+        if (testfs_dir_index_find(index, name))
+                return -EEXIST;
+        /* first fit */
+        list_for_each_entry(slot, &index->slots, list) {
+                int fit = testfs_dirent_fit(len, slot->d_name_len);
+
+                if (fit == 0)
+                        continue;
+                found = slot;
+                offset = slot->d_offset;
+                if (fit < slot->d_name_len)
+                        rest = slot->d_name_len - fit - sizeof(struct dirent);
+                len = fit;
+                break;
+        }
+        ret = testfs_write_dirent(dir, name, len, inode_nr, type, offset, 
+                                  rest);
+        if (ret < 0)
+                return ret;
+        dcache_insert(dir, name, inode_nr);
+        if (found) {
+                index->dead -= sizeof(struct dirent) + len;
+                if (rest) {
+                        found->d_offset += sizeof(struct dirent) + len;
+                        found->d_name_len = rest;
+                } else {
+                        list_del(&found->list);
+                        free(found);
+                }
+        }
+        if (testfs_dir_index_insert(index, name, inode_nr, offset) < 0)
+                testfs_dir_index_drop(dir);
+        return 0;
+}
+
 /* return 0 on success.
  * return negative value on error. */
 static int
-testfs_add_dirent(struct inode *dir, char *name, int inode_nr)
+testfs_add_dirent(struct inode *dir, char *name, int inode_nr, 
+                  inode_type type)
 {
+        struct dirent_iter it;
         struct dirent *d;
-        int p_offset = 0, offset = 0;
+        int p_offset;
         int found = 0;
         int ret = 0;
         int len = strlen(name) + 1;
+        int rest = 0;
+        struct dir_index *index;
 
-        assert(dir);
-        assert(testfs_inode_get_type(dir) == I_DIR);
         assert(name);
-        for (; ret == 0 && found == 0; free(d)) {
-                p_offset = offset;
-                if ((d = testfs_next_dirent(dir, &offset)) == NULL)
-                        break;
+        if ((index = testfs_dir_index_get(dir)))
+                return testfs_add_dirent_indexed(dir, index, name, inode_nr,
+                                                 type);
+        testfs_dirent_iter_init(&it, dir);
+        while ((d = testfs_dirent_iter_next(&it))) {
+                int fit;
+
                 if ((d->d_inode_nr >= 0) && (strcmp(D_NAME(d), name) == 0)) {
                         ret = -EEXIST;
-                        continue;
+                        break;
                 }
-                if ((d->d_inode_nr >= 0) || (d->d_name_len != len))
+                if ((d->d_inode_nr >= 0) || 
+                    (fit = testfs_dirent_fit(len, d->d_name_len)) == 0)
                         continue;
+                if (fit < d->d_name_len)
+                        rest = d->d_name_len - fit - sizeof(struct dirent);
+                len = fit;
                 found = 1;
+                break;
         }
+        p_offset = d ? it.d_offset : it.offset;
+        testfs_dirent_iter_destroy(&it);
+        if (ret == 0)
+                ret = it.error;
         if (ret < 0)
                 return ret;
         assert(found || (p_offset == testfs_inode_get_size(dir)));
-        return testfs_write_dirent(dir, name, len, inode_nr, p_offset);
+        ret = testfs_write_dirent(dir, name, len, inode_nr, type, p_offset,
+                                  rest);
+        if (ret == 0)
+                dcache_insert(dir, name, inode_nr);
+        return ret;
 }
 
-
-/* returns negative value if name within dir is not empty */
+/* rewrites dir without its dead dirents, from the first dead one on, and
+ * truncates the tail. this is done when at least half of dir is dead, or
+ * when only its tail is dead, since that needs no rewrite. the index of
+ * dir is rebuilt on its next use.
+ * returns negative value on error. */
 static int
-testfs_remove_dirent_allowed(struct super_block *sb, int inode_nr)
+testfs_dir_compact(struct inode *dir)
 {
-        struct inode *dir;
-        int offset = 0;
+        struct dir_index *index = testfs_inode_get_dir_index(dir);
+        int size = testfs_inode_get_size(dir);
+        struct dirent_iter it;
         struct dirent *d;
+        int first_dead = -1;
+        int len = 0, dead = 0;
         int ret = 0;
+        char *buf;
 
-        dir = testfs_get_inode(sb, inode_nr);
-        if (testfs_inode_get_type(dir) != I_DIR)
+        if (index && index->dead * 2 < size)
+                return 0;
+        if ((buf = malloc(size)) == NULL)
+                return -ENOMEM;
+        testfs_dirent_iter_init(&it, dir);
+        while ((d = testfs_dirent_iter_next(&it))) {
+                if (d->d_inode_nr < 0) {
+                        if (first_dead < 0)
+                                first_dead = it.d_offset;
+                        dead += DIRENT_LEN(d);
+                } else if (first_dead >= 0) {
+                        memcpy(buf + len, d, DIRENT_LEN(d));
+                        len += DIRENT_LEN(d);
+                }
+        }
+        testfs_dirent_iter_destroy(&it);
+        if ((ret = it.error) < 0)
+                goto out;
+        if (dead == 0 || (len > 0 && dead * 2 < size))
+                goto out;
+        if (len > 0 && (ret = testfs_write_data(dir, first_dead, buf, len)) < 0)
                 goto out;
-        for (; ret == 0 && (d = testfs_next_dirent(dir, &offset)); free(d)) {
+        testfs_truncate_data(dir, first_dead + len);
+        if (index)
+                testfs_dir_index_drop(dir);
+out:
+        free(buf);
+        return ret;
+}
+
+/* returns negative value if in, which the caller has locked, is a
+ * directory that is not empty */
+static int
+testfs_remove_dirent_allowed(struct inode *in)
+{
+        struct dirent_iter it;
+        struct dirent *d;
+        int ret = 0;
+
+        if (testfs_inode_get_type(in) != I_DIR)
+                return 0;
+        testfs_dirent_iter_init(&it, in);
+        while (ret == 0 && (d = testfs_dirent_iter_next(&it))) {
                 if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), ".") == 0) || 
                     (strcmp(D_NAME(d), "..") == 0))
                         continue;
                 ret = -ENOTEMPTY;
         }
-out:
-        testfs_put_inode(dir);
+        testfs_dirent_iter_destroy(&it);
+        if (ret == 0)
+                ret = it.error;
         return ret;
 }
 
-/* returns inode_nr of dirent removed.
+/* testfs_remove_dirent for an indexed directory */
+static int
+testfs_remove_dirent_indexed(struct super_block *sb, struct inode *dir,
+                             struct dir_index *index, char *name)
+{
+        struct dir_index_entry *e = testfs_dir_index_find(index, name);
+        struct dirent dead;
+        int inode_nr;
+        int ret;
+
+        if (!e)
+                return -ENOENT;
+        inode_nr = e->d_inode_nr;
+        ret = testfs_read_data(dir, e->d_offset, (char *)&dead, 
+                               sizeof(struct dirent));
+        if (ret < 0)
+                return ret;
+        assert(dead.d_inode_nr == inode_nr);
+        dead.d_inode_nr = -1;
+        ret = testfs_write_data(dir, e->d_offset, (char *)&dead, 
+                                sizeof(struct dirent));
+        if (ret < 0)
+                return ret;
+        dcache_insert(dir, name, -ENOENT);
+        hlist_del(&e->hnode);
+        if (testfs_dir_index_add_slot(index, e->d_offset, dead.d_name_len) < 0)
+                testfs_dir_index_drop(dir);
+        free(e);
+        testfs_dir_compact(dir);
+        return inode_nr;
+}
+
+/* returns inode_nr of dirent removed. the caller has checked that it
+   can be removed.
    returns negative value if name is not found */
 static int
 testfs_remove_dirent(struct super_block *sb, struct inode *dir, char *name)
 {
-        struct dirent *d;
-        int p_offset, offset = 0;
-        int inode_nr = -1;
+        struct dirent_iter it;
+        struct dirent *d, dead;
+        struct dir_index *index;
         int ret = -ENOENT;
 
-        assert(dir);
         assert(name);
         if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
                 return -EINVAL;
         }
-        for (; inode_nr == -1; free(d)) {
-                p_offset = offset;
-                if ((d = testfs_next_dirent(dir, &offset)) == NULL)
-                        break;
+        if ((index = testfs_dir_index_get(dir)))
+                return testfs_remove_dirent_indexed(sb, dir, index, name);
+        testfs_dirent_iter_init(&it, dir);
+        while ((d = testfs_dirent_iter_next(&it))) {
+                int inode_nr;
+
                 if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), name) != 0))
                         continue;
                 /* found the dirent */
                 inode_nr = d->d_inode_nr;
-                if ((ret = testfs_remove_dirent_allowed(sb, inode_nr)) < 0)
-                        continue; /* this will break out of the loop */
-                d->d_inode_nr = -1;
-                ret = testfs_write_data(dir, p_offset, (char *)d, 
-                                        sizeof(struct dirent) + d->d_name_len);
-                if (ret >= 0)
+                /* only the header changes */
+                memcpy(&dead, d, sizeof(struct dirent));
+                dead.d_inode_nr = -1;
+                ret = testfs_write_data(dir, it.d_offset, (char *)&dead, 
+                                        sizeof(struct dirent));
+                if (ret >= 0) {
+                        dcache_insert(dir, name, -ENOENT);
                         ret = inode_nr;
+                }
+                break;
         }
+        testfs_dirent_iter_destroy(&it);
+        if (!d && it.error < 0)
+                ret = it.error;
+        if (ret >= 0)
+                testfs_dir_compact(dir);
         return ret;
 }
 
@@ -172,10 +718,10 @@ testfs_create_empty_dir(struct super_block *sb, int p_inode_nr,
         int ret;
 
         assert(testfs_inode_get_type(cdir) == I_DIR);
-        ret = testfs_add_dirent(cdir, ".", testfs_inode_get_nr(cdir));
+        ret = testfs_add_dirent(cdir, ".", testfs_inode_get_nr(cdir), I_DIR);
         if (ret < 0)
                 return ret;
-        ret = testfs_add_dirent(cdir, "..", p_inode_nr);
+        ret = testfs_add_dirent(cdir, "..", p_inode_nr, I_DIR);
         if (ret < 0) {
                 testfs_remove_dirent(sb, cdir, ".");
                 return ret;
@@ -183,6 +729,8 @@ testfs_create_empty_dir(struct super_block *sb, int p_inode_nr,
         return 0;
 }
 
+static int testfs_dir_lookup(struct inode *dir, char *name);
+
 static int
 testfs_create_file_or_dir(struct super_block *sb, struct inode *dir,
                           inode_type type, char *name)
@@ -191,14 +739,21 @@ testfs_create_file_or_dir(struct super_block *sb, struct inode *dir,
         struct inode *in;
         int inode_nr;
 
+        if (dir && testfs_dir_name_to_inode_nr(dir, name) >= 0)
+                return -EEXIST;
+        testfs_tx_start(sb, TX_CREATE);
         if (dir) {
-                inode_nr = testfs_dir_name_to_inode_nr(dir, name);
-                if (inode_nr >= 0)
-                        return -EEXIST;
+                testfs_inode_wrlock(dir);
+                /* dir may have been removed, or name created, meanwhile */
+                if (testfs_inode_get_type(dir) != I_DIR)
+                        ret = -ENOENT;
+                else if (testfs_dir_lookup(dir, name) >= 0)
+                        ret = -EEXIST;
+                if (ret < 0)
+                        goto fail;
         }
-        testfs_tx_start(sb, TX_CREATE);
         /* first create inode */
-        ret = testfs_create_inode(sb, type, &in);
+        ret = testfs_create_inode(sb, dir, type, &in);
         if (ret < 0) {
                 goto fail;
         }
@@ -211,66 +766,227 @@ testfs_create_file_or_dir(struct super_block *sb, struct inode *dir,
         }
         /* then add directory entry */
         if (dir) {
-                if ((ret = testfs_add_dirent(dir, name, inode_nr)) < 0)
+                if ((ret = testfs_add_dirent(dir, name, inode_nr, type)) < 0)
                         goto out;
                 testfs_sync_inode(dir);
         }
         testfs_sync_inode(in);
+        testfs_inode_unlock(in);
         testfs_put_inode(in);
+        if (dir)
+                testfs_inode_unlock(dir);
         testfs_tx_commit(sb, TX_CREATE);
         return 0;
 out:
+        /* a failed add may have grown the directory and rolled it back */
+        if (dir && testfs_inode_is_dirty(dir))
+                testfs_sync_inode(dir);
         testfs_remove_inode(in);
 fail:
+        if (dir)
+                testfs_inode_unlock(dir);
         testfs_tx_commit(sb, TX_CREATE);
         return ret;
 }
 
+/* sets *p_inp to the parent of directory in, or to NULL if in is the
+ * root, and *namep to the name of in. the parent is looked up the first
+ * time and cached in in after that.
+ * returns negative value on error, e.g., when in has been removed. */
 static int
-testfs_pwd(struct super_block *sb, struct inode *in)
+testfs_dir_parent(struct inode *in, struct inode **p_inp, const char **namep)
 {
+        struct inode *p_in = testfs_inode_get_parent(in, namep);
+        struct dirent *d;
         int p_inode_nr;
+
+        *p_inp = p_in;
+        if (p_in)
+                return 0;
+        p_inode_nr = testfs_dir_name_to_inode_nr(in, "..");
+        if (p_inode_nr < 0)
+                return p_inode_nr;
+        if (p_inode_nr == testfs_inode_get_nr(in))
+                return 0;
+        p_in = testfs_get_inode(testfs_inode_get_sb(in), p_inode_nr);
+        testfs_inode_rdlock(p_in);
+        d = (testfs_inode_get_type(p_in) == I_DIR) ?
+                testfs_find_dirent(p_in, testfs_inode_get_nr(in)) : NULL;
+        testfs_inode_unlock(p_in);
+        if (d) {
+                testfs_inode_set_parent(in, p_in, D_NAME(d));
+                free(d);
+        }
+        testfs_put_inode(p_in);
+        if (!d)
+                return -ENOENT;
+        *p_inp = testfs_inode_get_parent(in, namep);
+        return 0;
+}
+
+/* prints the path of in. returns 1 if in is the root, 0 if not, or
+ * negative value on error */
+static int
+testfs_pwd(struct super_block *sb, struct inode *in)
+{
         struct inode *p_in;
-        struct dirent *d;
+        const char *name;
         int ret;
 
         assert(in);
         assert(testfs_inode_get_nr(in) >= 0);
-        p_inode_nr = testfs_dir_name_to_inode_nr(in, "..");
-        assert(p_inode_nr >= 0);
-        if (p_inode_nr == testfs_inode_get_nr(in)) {
+        if ((ret = testfs_dir_parent(in, &p_in, &name)) < 0)
+                return ret;
+        if (!p_in) {
                 printf("/");
                 return 1;
         }
-        p_in = testfs_get_inode(sb, p_inode_nr);
-        d = testfs_find_dirent(p_in, testfs_inode_get_nr(in));
-        assert(d);
-        ret = testfs_pwd(sb, p_in);
-        testfs_put_inode(p_in);
-        printf("%s%s", ret == 1 ? "" : "/", D_NAME(d));
-        free(d);
+        if ((ret = testfs_pwd(sb, p_in)) < 0)
+                return ret;
+        printf("%s%s", ret == 1 ? "" : "/", name);
         return 0;
 }
 
-/* returns negative value if name is not found */
-int
-testfs_dir_name_to_inode_nr(struct inode *dir, char *name)
+/* returns 1 if directory inode_nr is dir or one of its ancestors, 0 if
+ * not, or negative value on error */
+static int
+testfs_dir_is_ancestor(struct inode *dir, int inode_nr)
 {
+        struct inode *p_in;
+        const char *name;
+        int ret;
+
+        for (; dir; dir = p_in) {
+                if (testfs_inode_get_nr(dir) == inode_nr)
+                        return 1;
+                if ((ret = testfs_dir_parent(dir, &p_in, &name)) < 0)
+                        return ret;
+        }
+        return 0;
+}
+
+/* looks up name in dir, which the caller has write locked, since the
+ * lookup may index dir.
+ * returns negative value if name is not found */
+static int
+testfs_dir_lookup(struct inode *dir, char *name)
+{
+        struct dirent_iter it;
         struct dirent *d;
-        int offset = 0;
+        struct dir_index *index;
         int ret = -ENOENT;
 
-        assert(dir);
         assert(name);
         assert(testfs_inode_get_type(dir) == I_DIR);
-        for (; ret < 0 && (d = testfs_next_dirent(dir, &offset)); free(d)) {
+        if (dcache_find(dir, name, &ret))
+                return ret;
+        if ((index = testfs_dir_index_get(dir))) {
+                struct dir_index_entry *e = testfs_dir_index_find(index, name);
+                ret = e ? e->d_inode_nr : -ENOENT;
+                goto out;
+        }
+        testfs_dirent_iter_init(&it, dir);
+        while (ret < 0 && (d = testfs_dirent_iter_next(&it))) {
                 if ((d->d_inode_nr < 0) || (strcmp(D_NAME(d), name) != 0))
                         continue;
                 ret = d->d_inode_nr;
         }
+        testfs_dirent_iter_destroy(&it);
+        /* a failed lookup is not cached */
+        if (ret < 0 && it.error < 0)
+                return it.error;
+out:
+        dcache_insert(dir, name, ret);
+        return ret;
+}
+
+/* returns negative value if name is not found */
+int
+testfs_dir_name_to_inode_nr(struct inode *dir, char *name)
+{
+        int ret;
+
+        if (dcache_find(dir, name, &ret))
+                return ret;
+        testfs_inode_wrlock(dir);
+        if (testfs_inode_get_type(dir) == I_DIR)
+                ret = testfs_dir_lookup(dir, name);
+        else    /* removed meanwhile */
+                ret = -ENOENT;
+        testfs_inode_unlock(dir);
         return ret;
 }
 
+/* resolves a slash separated path, from the root directory if it starts
+ * with a slash and from dir otherwise. each component is looked up in the
+ * dentry cache first, so a cached path is resolved without directory or
+ * inode I/O.
+ * returns negative value on error. */
+int
+testfs_path_to_inode_nr(struct inode *dir, const char *path)
+{
+        struct super_block *sb = testfs_inode_get_sb(dir);
+        int inode_nr = (*path == '/') ? 0 : testfs_inode_get_nr(dir);
+        char *copy, *name, *saveptr;
+
+        if ((copy = strdup(path)) == NULL)
+                return -ENOMEM;
+        for (name = strtok_r(copy, "/", &saveptr); inode_nr >= 0 && name; 
+             name = strtok_r(NULL, "/", &saveptr)) {
+                struct inode *in;
+
+                if (strcmp(name, ".") == 0)
+                        continue;
+                /* entries exist only for directories, no type check needed */
+                if (dcache_find_nr(sb, inode_nr, name, &inode_nr))
+                        continue;
+                in = testfs_get_inode(sb, inode_nr);
+                if (testfs_inode_get_type(in) != I_DIR)
+                        inode_nr = -ENOTDIR;
+                else
+                        inode_nr = testfs_dir_name_to_inode_nr(in, name);
+                testfs_put_inode(in);
+        }
+        free(copy);
+        return inode_nr;
+}
+
+/* splits path into the directory that holds its last component, which is
+ * returned in *dirp with a reference held, and the last component itself,
+ * which is returned in *namep and points into path. path is modified.
+ * returns negative value on error. */
+int
+testfs_path_to_parent(struct inode *dir, char *path, struct inode **dirp,
+                      char **namep)
+{
+        struct super_block *sb = testfs_inode_get_sb(dir);
+        char *slash;
+        int inode_nr;
+
+        /* ignore trailing slashes */
+        for (slash = path + strlen(path); slash > path && slash[-1] == '/';)
+                *--slash = 0;
+        if ((slash = strrchr(path, '/')) == NULL) {
+                *namep = path;
+                inode_nr = testfs_inode_get_nr(dir);
+        } else {
+                *slash = 0;
+                *namep = slash + 1;
+                inode_nr = testfs_path_to_inode_nr(dir, slash == path ? 
+                                                   "/" : path);
+        }
+        if (**namep == 0)
+                return -EINVAL;
+        if (inode_nr < 0)
+                return inode_nr;
+        *dirp = testfs_get_inode(sb, inode_nr);
+        if (testfs_inode_get_type(*dirp) != I_DIR) {
+                testfs_put_inode(*dirp);
+                return -ENOTDIR;
+        }
+        return 0;
+}
+
 int
 testfs_make_root_dir(struct super_block *sb)
 {
@@ -280,58 +996,107 @@ testfs_make_root_dir(struct super_block *sb)
 int
 cmd_cd(struct super_block *sb, struct context *c)
 {
-        int inode_nr;
-        struct inode *dir_inode;
+        int inode_nr = 0;
+        struct inode *dir_inode, *p_dir = NULL;
+        char *name = NULL;
+        int ret;
 
         if (c->nargs != 2) {
                 return -EINVAL;
         }
-        inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, c->cmd[1]);
-        if (inode_nr < 0)
-                return inode_nr;
+        /* the path is resolved through its parent, so that the directory
+         * can cache its parent for pwd. a path of slashes is the root. */
+        if (c->cmd[1][strspn(c->cmd[1], "/")] != 0) {
+                ret = testfs_path_to_parent(c->cur_dir, c->cmd[1], &p_dir, 
+                                            &name);
+                if (ret < 0)
+                        return ret;
+                inode_nr = testfs_dir_name_to_inode_nr(p_dir, name);
+                if (inode_nr < 0) {
+                        testfs_put_inode(p_dir);
+                        return inode_nr;
+                }
+        }
         dir_inode = testfs_get_inode(sb, inode_nr);
         if (testfs_inode_get_type(dir_inode) != I_DIR) {
+                ret = -ENOTDIR;
                 testfs_put_inode(dir_inode);
-                return -ENOTDIR;
+                goto out;
         }
+        if (p_dir && (strcmp(name, ".") != 0) && (strcmp(name, "..") != 0))
+                testfs_inode_set_parent(dir_inode, p_dir, name);
         testfs_put_inode(c->cur_dir);
         c->cur_dir = dir_inode;
-        return 0;
+        ret = 0;
+out:
+        if (p_dir)
+                testfs_put_inode(p_dir);
+        return ret;
 }
 
 int
 cmd_pwd(struct super_block *sb, struct context *c)
 {
+        int ret;
+
         if (c->nargs != 1) {
                 return -EINVAL;
         }
-        testfs_pwd(sb, c->cur_dir);
+        if ((ret = testfs_pwd(sb, c->cur_dir)) < 0)
+                return ret;
         printf("\n");
         return 0;
 }
 
+/* lists in to out. when w is not NULL, the subdirectories of in are
+ * queued to be listed after their dirents, in node. */
 static int
-testfs_ls(struct inode *in, int recursive)
+testfs_ls(struct inode *in, FILE *out, struct walk *w, struct walk_node *node)
 {
-        int offset = 0;
+        struct dirent_iter it;
         struct dirent *d;
 
-        for (; (d = testfs_next_dirent(in, &offset)); free(d)) {
-                struct inode *cin;
+        testfs_inode_rdlock(in);
+        if (testfs_inode_get_type(in) != I_DIR) { /* removed meanwhile */
+                testfs_inode_unlock(in);
+                return -ENOENT;
+        }
+        testfs_dirent_iter_init(&it, in);
+        while ((d = testfs_dirent_iter_next(&it))) {
+                inode_type type = d->d_type;
 
                 if (d->d_inode_nr < 0)
                         continue;
-                cin = testfs_get_inode(testfs_inode_get_sb(in), d->d_inode_nr);
-                printf("%s%s\n", D_NAME(d), 
-                       (testfs_inode_get_type(cin) == I_DIR) ? "/":"");
-                if (recursive && testfs_inode_get_type(cin) == I_DIR &&
+                /* the inode is only needed if the dirent has no type */
+                if (type == I_NONE) {
+                        struct inode *cin;
+
+                        cin = testfs_get_inode(testfs_inode_get_sb(in), 
+                                               d->d_inode_nr);
+                        type = testfs_inode_get_type(cin);
+                        testfs_put_inode(cin);
+                }
+                fprintf(out, "%s%s\n", D_NAME(d), (type == I_DIR) ? "/":"");
+                if (w && type == I_DIR &&
                     (strcmp(D_NAME(d), ".") != 0) && 
                     (strcmp(D_NAME(d), "..") != 0)) {
-                        testfs_ls(cin, recursive);
+                        walk_add_child(w, node, d->d_inode_nr);
                 }
-                testfs_put_inode(cin);
         }
-        return 0;
+        testfs_dirent_iter_destroy(&it);
+        testfs_inode_unlock(in);
+        return it.error;
+}
+
+static int
+testfs_ls_visit(struct walk *w, struct walk_node *node, int thread, void *arg)
+{
+        struct inode *in = testfs_get_inode(arg, walk_node_inode_nr(node));
+        int ret;
+
+        ret = testfs_ls(in, walk_node_out(node), w, node);
+        testfs_put_inode(in);
+        return ret;
 }
 
 int
@@ -340,6 +1105,7 @@ cmd_ls(struct super_block *sb, struct context *c)
         int inode_nr;
         struct inode *in;
         char *cdir = ".";
+        int ret;
 
         if (c->nargs != 1 && c->nargs != 2) {
                 return -EINVAL;
@@ -348,13 +1114,13 @@ cmd_ls(struct super_block *sb, struct context *c)
                 cdir = c->cmd[1];
         }
         assert(c->cur_dir);
-        inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, cdir);
+        inode_nr = testfs_path_to_inode_nr(c->cur_dir, cdir);
         if (inode_nr < 0)
                 return inode_nr;
         in = testfs_get_inode(sb, inode_nr);
-        testfs_ls(in, 0);
+        ret = testfs_ls(in, stdout, NULL, NULL);
         testfs_put_inode(in);
-        return 0;
+        return ret;
 }
 
 int
@@ -371,22 +1137,34 @@ cmd_lsr(struct super_block *sb, struct context *c)
                 cdir = c->cmd[1];
         }
         assert(c->cur_dir);
-        inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, cdir);
+        inode_nr = testfs_path_to_inode_nr(c->cur_dir, cdir);
         if (inode_nr < 0)
                 return inode_nr;
         in = testfs_get_inode(sb, inode_nr);
-        testfs_ls(in, 1);
+        if (testfs_inode_get_type(in) != I_DIR) {
+                testfs_put_inode(in);
+                return -ENOTDIR;
+        }
         testfs_put_inode(in);
-        return 0;
+        return testfs_walk(sb, inode_nr, testfs_ls_visit, sb);
 }
 
 int
 cmd_create(struct super_block *sb, struct context *c)
 {
+        struct inode *dir;
+        char *name;
+        int ret;
+
         if (c->nargs != 2) {
                 return -EINVAL;
         }
-        return testfs_create_file_or_dir(sb, c->cur_dir, I_FILE, c->cmd[1]);
+        ret = testfs_path_to_parent(c->cur_dir, c->cmd[1], &dir, &name);
+        if (ret < 0)
+                return ret;
+        ret = testfs_create_file_or_dir(sb, dir, I_FILE, name);
+        testfs_put_inode(dir);
+        return ret;
 }
 
 int
@@ -401,13 +1179,15 @@ cmd_stat(struct super_block *sb, struct context *c)
         }   
         for (i = 1; i < c->nargs; i++ )
         {
-                inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, c->cmd[i]);
+                inode_nr = testfs_path_to_inode_nr(c->cur_dir, c->cmd[i]);
                 if (inode_nr < 0)
                         return inode_nr;
                 in = testfs_get_inode(sb, inode_nr);
+                testfs_inode_rdlock(in);
                 printf("%s: i_nr = %d, i_type = %d, i_size = %d\n", c->cmd[i], 
                        testfs_inode_get_nr(in), testfs_inode_get_type(in), 
                        testfs_inode_get_size(in));
+                testfs_inode_unlock(in);
                 testfs_put_inode(in);
         }
         return 0;
@@ -417,29 +1197,72 @@ int
 cmd_rm(struct super_block *sb, struct context *c)
 {
         int inode_nr;
-        struct inode *in;
+        struct inode *in, *dir;
+        char *name;
+        int ret;
 
         if (c->nargs != 2) {
                 return -EINVAL;
         }
-        testfs_tx_start(sb, TX_RM);
-        inode_nr = testfs_remove_dirent(sb, c->cur_dir, c->cmd[1]);
-        if (inode_nr < 0) {
-                testfs_tx_commit(sb, TX_RM);
-                return inode_nr;
+        ret = testfs_path_to_parent(c->cur_dir, c->cmd[1], &dir, &name);
+        if (ret < 0)
+                return ret;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                ret = -EINVAL;
+                goto out;
+        }
+        /* the current directory and its ancestors stay. their parents are
+         * cached, and directories are never renamed, so the check holds
+         * once the locks are taken. */
+        inode_nr = testfs_dir_name_to_inode_nr(dir, name);
+        if (inode_nr >= 0 && 
+            (ret = testfs_dir_is_ancestor(c->cur_dir, inode_nr)) != 0) {
+                if (ret > 0)
+                        ret = -EBUSY;
+                goto out;
         }
+        testfs_tx_start(sb, TX_RM);
+        /* the directory and then the inode are locked, so that the inode
+         * stays empty until it is removed */
+        testfs_inode_wrlock(dir);
+        ret = -ENOENT;
+        if (testfs_inode_get_type(dir) != I_DIR ||
+            (inode_nr = testfs_dir_lookup(dir, name)) < 0)
+                goto unlock;
         in = testfs_get_inode(sb, inode_nr);
+        testfs_inode_wrlock(in);
+        if ((ret = testfs_remove_dirent_allowed(in)) < 0 ||
+            (ret = testfs_remove_dirent(sb, dir, name)) < 0) {
+                testfs_inode_unlock(in);
+                testfs_put_inode(in);
+                goto unlock;
+        }
+        assert(ret == inode_nr);
+        ret = 0;
         testfs_remove_inode(in);
-        testfs_sync_inode(c->cur_dir);
+        testfs_sync_inode(dir);
+unlock:
+        testfs_inode_unlock(dir);
         testfs_tx_commit(sb, TX_RM);
-        return 0;
+out:
+        testfs_put_inode(dir);
+        return ret;
 }
 
 int
 cmd_mkdir(struct super_block *sb, struct context *c)
 {
+        struct inode *dir;
+        char *name;
+        int ret;
+
         if (c->nargs != 2) {
                 return -EINVAL;
         }
-        return testfs_create_file_or_dir(sb, c->cur_dir, I_DIR, c->cmd[1]);
+        ret = testfs_path_to_parent(c->cur_dir, c->cmd[1], &dir, &name);
+        if (ret < 0)
+                return ret;
+        ret = testfs_create_file_or_dir(sb, dir, I_DIR, name);
+        testfs_put_inode(dir);
+        return ret;
 }
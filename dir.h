@@ -2,14 +2,40 @@
 #define _DIR_H
 
 struct dirent {
-        int d_name_len;
+        short d_name_len;
+        short d_type;           /* inode_type, I_NONE if not recorded */
         int d_inode_nr;
 };
 
 #define D_NAME(d) ((char*)(d) + sizeof(struct dirent))
 
-struct dirent *testfs_next_dirent(struct inode *dir, int *offset);
+struct dir_index;
+
+/* walks the dirents of a directory without copying them */
+struct dirent_iter {
+        struct inode *dir;
+        int offset;             /* offset of the next dirent */
+        int d_offset;           /* offset of the dirent last returned */
+        char *window;           /* directory data from w_start */
+        int w_start;
+        int w_len;
+        char *spill;            /* dirents that are copied */
+        int spill_size;
+        int error;              /* negative if the walk stopped on error */
+        char block[BLOCK_SIZE];
+};
+
+void testfs_dirent_iter_init(struct dirent_iter *it, struct inode *dir);
+struct dirent *testfs_dirent_iter_next(struct dirent_iter *it);
+void testfs_dirent_iter_destroy(struct dirent_iter *it);
+void dcache_init(struct super_block *sb);
+void dcache_destroy(struct super_block *sb);
+void dcache_purge(struct super_block *sb, int dir_nr);
+void testfs_dir_index_free(struct dir_index *index);
 int testfs_dir_name_to_inode_nr(struct inode *dir, char *name);
+int testfs_path_to_inode_nr(struct inode *dir, const char *path);
+int testfs_path_to_parent(struct inode *dir, char *path, struct inode **dirp,
+                          char **namep);
 int testfs_make_root_dir(struct super_block *sb);
 
 #endif /* _DIR_H */
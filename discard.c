@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include "testfs.h"
+#include "super.h"
+#include "bitmap.h"
+#include "discard.h"
+
+/* freed data blocks are punched out of the image file in the background.
+ * a freed block waits DISCARD_DELAY seconds so that neighbouring frees
+ * can be punched as one range. */
+#define DISCARD_DELAY 1
+
+struct discard {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct bitmap *pending;         /* freed, not punched yet */
+        int nr_pending;
+        int stop;
+        int failed;                     /* punching is not supported */
+};
+
+#define DISCARD_NBITS (BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD)
+
+/* punch out all pending blocks, called with d->lock held */
+static void
+testfs_discard_pending(struct super_block *sb, struct discard *d)
+{
+        int start, nr;
+
+        for (start = 0; d->nr_pending > 0 && start < DISCARD_NBITS; 
+             start += nr) {
+                nr = 0;
+                while (start + nr < DISCARD_NBITS && 
+                       bitmap_isset(d->pending, start + nr)) {
+                        bitmap_unmark(d->pending, start + nr);
+                        nr++;
+                }
+                if (nr == 0) {
+                        nr = 1;
+                        continue;
+                }
+                d->nr_pending -= nr;
+                if (d->failed)
+                        continue;
+                if (fallocate(fileno(sb->dev), 
+                              FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              (off_t)(sb->sb.data_blocks_start + start) *
+                              BLOCK_SIZE, (off_t)nr * BLOCK_SIZE) < 0) {
+                        WARN("fallocate");
+                        d->failed = 1;
+                }
+        }
+}
+
+static void *
+testfs_discard_thread(void *arg)
+{
+        struct super_block *sb = arg;
+        struct discard *d = sb->discard;
+
+        pthread_mutex_lock(&d->lock);
+        while (!d->stop) {
+                struct timespec ts;
+
+                if (d->nr_pending == 0) {
+                        pthread_cond_wait(&d->cond, &d->lock);
+                        continue;
+                }
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += DISCARD_DELAY;
+                pthread_cond_timedwait(&d->cond, &d->lock, &ts);
+                testfs_discard_pending(sb, d);
+        }
+        testfs_discard_pending(sb, d);
+        pthread_mutex_unlock(&d->lock);
+        return NULL;
+}
+
+/* start punching freed blocks in the background.
+ * returns negative value on error. */
+int
+testfs_discard_init(struct super_block *sb)
+{
+        struct discard *d;
+        int ret;
+
+        assert(!sb->discard);
+        if ((d = calloc(1, sizeof(struct discard))) == NULL)
+                return -ENOMEM;
+        ret = bitmap_create(DISCARD_NBITS, &d->pending);
+        if (ret < 0) {
+                free(d);
+                return ret;
+        }
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        sb->discard = d;
+        if ((ret = pthread_create(&d->thread, NULL, testfs_discard_thread, 
+                                  sb)) != 0) {
+                sb->discard = NULL;
+                bitmap_destroy(d->pending);
+                free(d);
+                return -ret;
+        }
+        return 0;
+}
+
+/* punch out the remaining freed blocks and stop the background thread */
+void
+testfs_discard_destroy(struct super_block *sb)
+{
+        struct discard *d = sb->discard;
+
+        pthread_mutex_lock(&d->lock);
+        d->stop = 1;
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->thread, NULL);
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->cond);
+        bitmap_destroy(d->pending);
+        free(d);
+        sb->discard = NULL;
+}
+
+/* queue a freed block to be punched out */
+void
+testfs_discard_block(struct super_block *sb, int block_nr)
+{
+        struct discard *d = sb->discard;
+
+        block_nr -= sb->sb.data_blocks_start;
+        assert(block_nr >= 0 && block_nr < DISCARD_NBITS);
+        pthread_mutex_lock(&d->lock);
+        bitmap_mark(d->pending, block_nr);
+        if (d->nr_pending++ == 0)
+                pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+}
+
+/* a block has been allocated again, it must not be punched out after it is
+ * written. a punch in progress completes before this returns. */
+void
+testfs_discard_cancel(struct super_block *sb, int block_nr)
+{
+        struct discard *d = sb->discard;
+
+        block_nr -= sb->sb.data_blocks_start;
+        assert(block_nr >= 0 && block_nr < DISCARD_NBITS);
+        pthread_mutex_lock(&d->lock);
+        if (bitmap_isset(d->pending, block_nr)) {
+                bitmap_unmark(d->pending, block_nr);
+                d->nr_pending--;
+        }
+        pthread_mutex_unlock(&d->lock);
+}
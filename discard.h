@@ -0,0 +1,11 @@
+#ifndef _DISCARD_H
+#define _DISCARD_H
+
+struct super_block;
+
+int testfs_discard_init(struct super_block *sb);
+void testfs_discard_destroy(struct super_block *sb);
+void testfs_discard_block(struct super_block *sb, int block_nr);
+void testfs_discard_cancel(struct super_block *sb, int block_nr);
+
+#endif /* _DISCARD_H */
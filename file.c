@@ -1,8 +1,40 @@
+#include <limits.h>
 #include "testfs.h"
 #include "inode.h"
 #include "dir.h"
 #include "tx.h"
 
+/* returns negative value unless in, which the caller has locked, is a
+ * file. it may have been removed since it was looked up. */
+static int
+testfs_check_file(struct inode *in)
+{
+        switch (testfs_inode_get_type(in)) {
+        case I_FILE:
+                return 0;
+        case I_DIR:
+                return -EISDIR;
+        default:
+                return -ENOENT;
+        }
+}
+
+/* parses str, a non-negative decimal number, into *nrp.
+ * returns negative value if str is not one. */
+int
+testfs_parse_nr(const char *str, int *nrp)
+{
+        char *end;
+        long nr;
+
+        errno = 0;
+        nr = strtol(str, &end, 10);
+        if (errno != 0 || end == str || *end != 0 || nr < 0 || nr > INT_MAX)
+                return -EINVAL;
+        *nrp = nr;
+        return 0;
+}
+
 int
 cmd_cat(struct super_block *sb, struct context *c)
 {
@@ -18,14 +50,13 @@ cmd_cat(struct super_block *sb, struct context *c)
         }    
         for (i = 1; ret == 0 && i < c->nargs; i++ )
         {
-                inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, c->cmd[i]);
+                inode_nr = testfs_path_to_inode_nr(c->cur_dir, c->cmd[i]);
                 if (inode_nr < 0)
                         return inode_nr;
                 in = testfs_get_inode(sb, inode_nr);
-                if (testfs_inode_get_type(in) == I_DIR) {
-                        ret = -EISDIR;
+                testfs_inode_rdlock(in);
+                if ((ret = testfs_check_file(in)) < 0)
                         goto out;
-                }
                 sz = testfs_inode_get_size(in);
                 if (sz > 0) {
                         buf = malloc(sz + 1);
@@ -39,6 +70,7 @@ cmd_cat(struct super_block *sb, struct context *c)
                         free(buf);
                 }
 out:
+                testfs_inode_unlock(in);
                 testfs_put_inode(in);                
         }
 
@@ -58,24 +90,94 @@ cmd_write(struct super_block *sb, struct context *c)
         if (c->nargs != 3) {
                 return -EINVAL;
         }
-        inode_nr = testfs_dir_name_to_inode_nr(c->cur_dir, filename);
+        inode_nr = testfs_path_to_inode_nr(c->cur_dir, filename);
         if (inode_nr < 0)
                 return inode_nr;
         in = testfs_get_inode(sb, inode_nr);
-        if (testfs_inode_get_type(in) == I_DIR) {
-                ret = -EISDIR;
-                goto out;
-        }
         size = strlen(content);
         testfs_tx_start(sb, TX_WRITE);
+        testfs_inode_wrlock(in);
+        if ((ret = testfs_check_file(in)) < 0)
+                goto out;
         ret = testfs_write_data(in, 0, content, size);
         if (ret >= 0) {
                 testfs_truncate_data(in, size);
         }
         testfs_sync_inode(in);
+out:
+        testfs_inode_unlock(in);
         testfs_tx_commit(sb, TX_WRITE);
+        testfs_put_inode(in);
+        return ret;
+}
+
+int
+cmd_pwrite(struct super_block *sb, struct context *c)
+{
+        int inode_nr;
+        struct inode *in;
+        int offset;
+        int ret = 0;
+        char * filename = c->cmd[1];
+        char * content = c->cmd[3];
+
+        if (c->nargs != 4) {
+                return -EINVAL;
+        }
+        if (testfs_parse_nr(c->cmd[2], &offset) < 0) {
+                return -EINVAL;
+        }
+        if (strlen(content) > (size_t)(INT_MAX - offset)) {
+                return -EFBIG;
+        }
+        inode_nr = testfs_path_to_inode_nr(c->cur_dir, filename);
+        if (inode_nr < 0)
+                return inode_nr;
+        in = testfs_get_inode(sb, inode_nr);
+        testfs_tx_start(sb, TX_WRITE);
+        testfs_inode_wrlock(in);
+        if ((ret = testfs_check_file(in)) < 0)
+                goto out;
+        ret = testfs_write_data(in, offset, content, strlen(content));
+        testfs_sync_inode(in);
 out:
+        testfs_inode_unlock(in);
+        testfs_tx_commit(sb, TX_WRITE);
         testfs_put_inode(in);
         return ret;
 }
 
+int
+cmd_fallocate(struct super_block *sb, struct context *c)
+{
+        int inode_nr;
+        struct inode *in;
+        int offset, len;
+        int ret = 0;
+
+        if (c->nargs != 4) {
+                return -EINVAL;
+        }
+        if (testfs_parse_nr(c->cmd[2], &offset) < 0 ||
+            testfs_parse_nr(c->cmd[3], &len) < 0 || len == 0) {
+                return -EINVAL;
+        }
+        if (len > INT_MAX - offset) {
+                return -EFBIG;
+        }
+        inode_nr = testfs_path_to_inode_nr(c->cur_dir, c->cmd[1]);
+        if (inode_nr < 0)
+                return inode_nr;
+        in = testfs_get_inode(sb, inode_nr);
+        testfs_tx_start(sb, TX_WRITE);
+        testfs_inode_wrlock(in);
+        if ((ret = testfs_check_file(in)) < 0)
+                goto out;
+        ret = testfs_prealloc_data(in, offset, len);
+        testfs_sync_inode(in);
+out:
+        testfs_inode_unlock(in);
+        testfs_tx_commit(sb, TX_WRITE);
+        testfs_put_inode(in);
+        return ret;
+}
@@ -3,21 +3,49 @@
 #include "block.h"
 #include "inode.h"
 #include "list.h"
+#include "rcu.h"
 #include "csum.h"
+#include "dir.h"
 
 /* inode flags */
 #define I_FLAGS_DIRTY     0x1
+#define I_FLAGS_REMOVED   0x2   /* not in the hash table, see remove */
 
+/* flush all delayed blocks once this many blocks are reserved for them */
+#define DA_MAX_RESERVED_BLOCKS 64
+
+/* the fields of an inode, and the data of a directory, are protected by
+ * i_rwlock. hnode, i_da_list, i_parent and i_name are protected by
+ * sb->inode_lock instead. i_count is changed atomically, and is only
+ * raised from zero with sb->inode_lock held. */
 struct inode {
         int i_flags;
         struct dinode in;
         int i_nr;
         struct hlist_node hnode; /* keep these structures in a hash table */
         int i_count;
+        struct rcu_head rcu;
         struct super_block *sb;
-};
+        pthread_rwlock_t i_rwlock;
+
+        /* delayed allocation. blocks written while sb->delalloc is set are
+         * kept in i_da_data until testfs_flush_inodes assigns them
+         * physical blocks. an inode with delayed blocks stays cached after
+         * its last reference is put. */
+        char *i_da_data;                        /* MAX_FILE_BLOCKS blocks */
+        char i_da_valid[MAX_FILE_BLOCKS];       /* block is in i_da_data */
+        int i_da_nr;                            /* nr of valid blocks */
+        int i_da_reserved;                      /* blocks reserved in sb */
+        struct list_head i_da_list;             /* on sb->da_inodes */
+
+        struct dir_index *i_dir_index;          /* see dir.c */
 
-static struct hlist_head *inode_hash_table = NULL;
+        /* a directory caches its parent, with a reference held, and its
+         * name in the parent once they are known. directories are never
+         * renamed, so these stay valid until the directory is removed. */
+        struct inode *i_parent;
+        char *i_name;
+};
 
 #define INODE_HASH_SHIFT 8
 
@@ -26,29 +54,33 @@ static struct hlist_head *inode_hash_table = NULL;
 
 static const int inode_hash_size = (1 << INODE_HASH_SHIFT);
 
+/* each super block has its own table, so images opened in the same process
+ * do not share cached inodes. the table is changed with sb->inode_lock
+ * held, and looked up with that lock or in an rcu read section. */
 void
-inode_hash_init(void)
+inode_hash_init(struct super_block *sb)
 {
         int i;
 
-        inode_hash_table = malloc(inode_hash_size * sizeof(struct hlist_head));
-        if (!inode_hash_table) {
+        sb->inode_hash = malloc(inode_hash_size * sizeof(struct hlist_head));
+        if (!sb->inode_hash) {
                 EXIT("malloc");
         }
         for (i = 0; i < inode_hash_size; i++) {
-                INIT_HLIST_HEAD(&inode_hash_table[i]);
+                INIT_HLIST_HEAD(&sb->inode_hash[i]);
         }
 }
 
 void
-inode_hash_destroy(void)
+inode_hash_destroy(struct super_block *sb)
 {
         int i;
-        assert(inode_hash_table);
+        assert(sb->inode_hash);
         for (i = 0; i < inode_hash_size; i++) {
-                assert(hlist_empty(&inode_hash_table[i]));
+                assert(hlist_empty(&sb->inode_hash[i]));
         }
-        free(inode_hash_table);
+        free(sb->inode_hash);
+        sb->inode_hash = NULL;
 }
 
 static struct inode *
@@ -57,9 +89,10 @@ inode_hash_find(struct super_block *sb, int inode_nr)
         struct hlist_node *elem;
         struct inode *in;
 
-        hlist_for_each_entry(in, elem, 
-                             &inode_hash_table[inode_hashfn(inode_nr)], hnode) {
-                if ((in->sb == sb) && (in->i_nr == inode_nr)) {
+        hlist_for_each_entry_rcu(in, elem, 
+                                 &sb->inode_hash[inode_hashfn(inode_nr)],
+                                 hnode) {
+                if (in->i_nr == inode_nr) {
                         return in;
                 }
         }
@@ -70,14 +103,69 @@ static void
 inode_hash_insert(struct inode *in)
 {
         INIT_HLIST_NODE(&in->hnode);
-        hlist_add_head(&in->hnode, 
-                       &inode_hash_table[inode_hashfn(in->i_nr)]);
+        hlist_add_head_rcu(&in->hnode, 
+                           &in->sb->inode_hash[inode_hashfn(in->i_nr)]);
 }
 
 static void
 inode_hash_remove(struct inode *in)
 {
-        hlist_del(&in->hnode);
+        hlist_del_rcu(&in->hnode);
+}
+
+/* takes a reference to in, unless it has none, in which case it may be
+ * freed. returns 1 if it was taken. */
+static int
+inode_get_unless_zero(struct inode *in)
+{
+        int count = __atomic_load_n(&in->i_count, __ATOMIC_RELAXED);
+
+        while (count > 0) {
+                if (__atomic_compare_exchange_n(&in->i_count, &count, 
+                                                count + 1, 0, __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+                        return 1;
+        }
+        return 0;
+}
+
+static void testfs_put_inode_locked(struct inode *in);
+
+/* drop an unreferenced inode from memory, called with sb->inode_lock
+ * held. the memory is only queued here, and testfs_put_inode frees it with
+ * rcu_reclaim after it drops the lock. */
+static void
+testfs_free_inode(struct inode *in)
+{
+        assert(__atomic_load_n(&in->i_count, __ATOMIC_RELAXED) == 0 && 
+               in->i_da_nr == 0);
+        if (!(in->i_flags & I_FLAGS_REMOVED))
+                inode_hash_remove(in);
+        if (in->i_dir_index)
+                testfs_dir_index_free(in->i_dir_index);
+        if (in->i_parent)
+                testfs_put_inode_locked(in->i_parent);
+        pthread_rwlock_destroy(&in->i_rwlock);
+        free(in->i_name);
+        rcu_free(&in->rcu, in);
+}
+
+void
+testfs_inode_rdlock(struct inode *in)
+{
+        pthread_rwlock_rdlock(&in->i_rwlock);
+}
+
+void
+testfs_inode_wrlock(struct inode *in)
+{
+        pthread_rwlock_wrlock(&in->i_rwlock);
+}
+
+void
+testfs_inode_unlock(struct inode *in)
+{
+        pthread_rwlock_unlock(&in->i_rwlock);
 }
 
 static int
@@ -114,69 +202,272 @@ testfs_write_inode_block(struct inode *in, char *block)
                      in->sb->sb.inode_blocks_start + block_nr, 1);
 }
 
-/* given logical block number, read physical block
- * return physical block number.
+/* writes data blocks of in. the blocks of directories are metadata, and
+ * are always journaled. */
+static void
+testfs_write_data_blocks(struct inode *in, char *blocks, int start, int nr)
+{
+        if (in->in.i_type == I_FILE)
+                write_data_blocks(in->sb, blocks, start, nr);
+        else
+                write_blocks(in->sb, blocks, start, nr);
+}
+
+/* given logical block number, return physical block number without
+ * reading the block. indirect holds the contents of the indirect block,
+ * or is unused if the inode has no indirect block.
  * returns 0 if physical block does not exist.
  * returns negative value on other errors. */
 static int
-testfs_get_block(struct inode *in, char *block, int log_block_nr)
+testfs_map_block(struct inode *in, const int *indirect, int log_block_nr)
 {
-        int phy_block_nr;
-
         assert(log_block_nr >= 0);
-        if (log_block_nr < NR_DIRECT_BLOCKS) {
-                phy_block_nr = in->in.i_block_nr[log_block_nr];
-                goto read_block;
-        }
+        if (log_block_nr < NR_DIRECT_BLOCKS)
+                return in->in.i_block_nr[log_block_nr];
         log_block_nr -= NR_DIRECT_BLOCKS;
         if (log_block_nr >= NR_INDIRECT_BLOCKS)
                 return -EFBIG;
         if (in->in.i_indirect == 0)
                 return 0;
-        read_blocks(in->sb, block, in->in.i_indirect, 1);
-        phy_block_nr = ((int *)block)[log_block_nr];
-read_block:
-        if (phy_block_nr > 0)
-                read_blocks(in->sb, block, phy_block_nr, 1);
-        return phy_block_nr;
+        return indirect[log_block_nr];
+}
+
+/* the blocks of an inode are allocated in its group */
+static int
+testfs_inode_group(struct inode *in)
+{
+        return INODE_GROUP(in->i_nr);
+}
+
+/* returns whether log_block_nr is preallocated but not written yet */
+static int
+testfs_is_unwritten(struct inode *in, int log_block_nr)
+{
+        return (log_block_nr < MAX_FILE_BLOCKS) && 
+                (in->in.i_unwritten & (1 << log_block_nr));
+}
+
+/* mark nr blocks from log_block_nr as written */
+static void
+testfs_clear_unwritten(struct inode *in, int log_block_nr, int nr)
+{
+        int mask = ((1 << nr) - 1) << log_block_nr;
+
+        if (in->in.i_unwritten & mask) {
+                in->in.i_unwritten &= ~mask;
+                in->i_flags |= I_FLAGS_DIRTY;
+        }
 }
 
+/* given logical block number, return physical block number, allocating
+ * the block if it does not exist. when block is not NULL, it receives the
+ * current contents of the block (zeros for a newly allocated or an 
+ * unwritten block).
+ * indirect and indirect_dirty are as for testfs_map_block, and the caller
+ * must write back indirect when *indirect_dirty is set.
+ * returns negative value on error. */
 static int
-testfs_allocate_block(struct inode *in, char *block, int log_block_nr)
+testfs_bmap_alloc(struct inode *in, int *indirect, int *indirect_dirty,
+                  char *block, int log_block_nr)
 {
-        char indirect[BLOCK_SIZE];
         int phy_block_nr;
 
-        assert(log_block_nr >= 0);
-        phy_block_nr = testfs_get_block(in, block, log_block_nr);
-        if (phy_block_nr != 0)
+        phy_block_nr = testfs_map_block(in, indirect, log_block_nr);
+        if (phy_block_nr < 0)
                 return phy_block_nr;
-        if (log_block_nr < NR_DIRECT_BLOCKS) {
-                phy_block_nr = testfs_alloc_block(in->sb, block);
-                if (phy_block_nr < 0)
-                        return phy_block_nr;
-                in->in.i_block_nr[log_block_nr] = phy_block_nr;
-                in->i_flags |= I_FLAGS_DIRTY;
+        if (phy_block_nr > 0) {
+                if (block && testfs_is_unwritten(in, log_block_nr))
+                        bzero(block, BLOCK_SIZE);
+                else if (block)
+                        read_blocks(in->sb, block, phy_block_nr, 1);
                 return phy_block_nr;
         }
-        log_block_nr -= NR_DIRECT_BLOCKS;
-        assert(log_block_nr < NR_INDIRECT_BLOCKS);
-        if (in->in.i_indirect == 0) {
-                phy_block_nr = testfs_alloc_block(in->sb, indirect);
+        if (log_block_nr >= NR_DIRECT_BLOCKS && in->in.i_indirect == 0) {
+                phy_block_nr = testfs_alloc_block(in->sb, 
+                                testfs_inode_group(in), (char *)indirect);
                 if (phy_block_nr < 0)
                         return phy_block_nr;
                 in->in.i_indirect = phy_block_nr;
                 in->i_flags |= I_FLAGS_DIRTY;
+                *indirect_dirty = 1;
+        }
+        phy_block_nr = testfs_alloc_block(in->sb, testfs_inode_group(in), 
+                                          block);
+        if (phy_block_nr < 0)
+                return phy_block_nr;
+        if (log_block_nr < NR_DIRECT_BLOCKS) {
+                in->in.i_block_nr[log_block_nr] = phy_block_nr;
+                in->i_flags |= I_FLAGS_DIRTY;
         } else {
-                read_blocks(in->sb, indirect, in->in.i_indirect, 1);
+                indirect[log_block_nr - NR_DIRECT_BLOCKS] = phy_block_nr;
+                *indirect_dirty = 1;
         }
-        phy_block_nr = testfs_alloc_block(in->sb, block);
-        if (phy_block_nr > 0)
-                ((int *)indirect)[log_block_nr] = phy_block_nr;
-        write_blocks(in->sb, indirect, in->in.i_indirect, 1);
         return phy_block_nr;
 }
 
+/* number of blocks that flushing the delayed blocks of in will allocate */
+static int
+testfs_da_needed(struct inode *in)
+{
+        int i;
+
+        if (in->in.i_indirect == 0) {
+                for (i = NR_DIRECT_BLOCKS; i < MAX_FILE_BLOCKS; i++) {
+                        if (in->i_da_valid[i])
+                                return in->i_da_nr + 1;
+                }
+        }
+        return in->i_da_nr;
+}
+
+/* adjust the blocks reserved for in to match its delayed blocks.
+ * returns negative value on error. */
+static int
+testfs_da_reserve(struct inode *in)
+{
+        int needed = testfs_da_needed(in);
+        int ret;
+
+        ret = testfs_reserve_blocks(in->sb, needed - in->i_da_reserved);
+        if (ret < 0)
+                return ret;
+        in->i_da_reserved = needed;
+        return 0;
+}
+
+/* copy buf[size] into delayed block log_block_nr at offset b_offset,
+ * adding the block if it is not delayed yet.
+ * returns negative value on error. */
+static int
+testfs_da_write(struct inode *in, int log_block_nr, int b_offset, 
+                const char *buf, int size)
+{
+        int ret;
+
+        assert(log_block_nr < MAX_FILE_BLOCKS);
+        if (!in->i_da_data) {
+                in->i_da_data = calloc(MAX_FILE_BLOCKS, BLOCK_SIZE);
+                if (!in->i_da_data)
+                        return -ENOMEM;
+        }
+        if (!in->i_da_valid[log_block_nr]) {
+                in->i_da_valid[log_block_nr] = 1;
+                in->i_da_nr++;
+                if ((ret = testfs_da_reserve(in)) < 0) {
+                        in->i_da_valid[log_block_nr] = 0;
+                        in->i_da_nr--;
+                        return ret;
+                }
+                if (in->i_da_nr == 1) {
+                        pthread_mutex_lock(&in->sb->inode_lock);
+                        list_add_tail(&in->i_da_list, &in->sb->da_inodes);
+                        pthread_mutex_unlock(&in->sb->inode_lock);
+                }
+        }
+        memcpy(in->i_da_data + log_block_nr * BLOCK_SIZE + b_offset, buf, 
+               size);
+        return 0;
+}
+
+/* copy delayed block log_block_nr, from b_offset, into buf[size].
+ * returns 0 when the block is not delayed. */
+static int
+testfs_da_read(struct inode *in, int log_block_nr, int b_offset, char *buf,
+               int size)
+{
+        if (log_block_nr >= MAX_FILE_BLOCKS || !in->i_da_valid[log_block_nr])
+                return 0;
+        memcpy(buf, in->i_da_data + log_block_nr * BLOCK_SIZE + b_offset, size);
+        return 1;
+}
+
+/* drop delayed block log_block_nr.
+ * returns 0 when the block is not delayed. */
+static int
+testfs_da_forget(struct inode *in, int log_block_nr)
+{
+        if (log_block_nr >= MAX_FILE_BLOCKS || !in->i_da_valid[log_block_nr])
+                return 0;
+        in->i_da_valid[log_block_nr] = 0;
+        bzero(in->i_da_data + log_block_nr * BLOCK_SIZE, BLOCK_SIZE);
+        if (--in->i_da_nr == 0) {
+                pthread_mutex_lock(&in->sb->inode_lock);
+                list_del(&in->i_da_list);
+                pthread_mutex_unlock(&in->sb->inode_lock);
+                free(in->i_da_data);
+                in->i_da_data = NULL;
+        }
+        testfs_da_reserve(in);
+        return 1;
+}
+
+/* assign physical blocks to the delayed blocks of in, contiguously when
+ * possible, and write them out */
+static void
+testfs_da_flush(struct inode *in)
+{
+        int phy_block_nr[MAX_FILE_BLOCKS];
+        int indirect[NR_INDIRECT_BLOCKS];
+        int indirect_dirty = 0;
+        int i, nr, start;
+
+        if (in->i_da_nr == 0)
+                return;
+        /* the reservation guarantees that the allocations below succeed */
+        testfs_reserve_blocks(in->sb, -in->i_da_reserved);
+        in->i_da_reserved = 0;
+        if (in->in.i_indirect) {
+                read_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        } else if (testfs_da_needed(in) > in->i_da_nr) {
+                in->in.i_indirect = testfs_alloc_block(in->sb, 
+                        testfs_inode_group(in), (char *)indirect);
+                assert(in->in.i_indirect > 0);
+                indirect_dirty = 1;
+        }
+        start = testfs_alloc_blocks(in->sb, testfs_inode_group(in), 
+                                    in->i_da_nr);
+        for (i = 0, nr = 0; i < MAX_FILE_BLOCKS; i++) {
+                if (!in->i_da_valid[i])
+                        continue;
+                if (start > 0) {
+                        phy_block_nr[i] = start + nr++;
+                } else { /* no contiguous range left */
+                        phy_block_nr[i] = testfs_alloc_block(in->sb, 
+                                testfs_inode_group(in), NULL);
+                        assert(phy_block_nr[i] > 0);
+                }
+                if (i < NR_DIRECT_BLOCKS) {
+                        in->in.i_block_nr[i] = phy_block_nr[i];
+                } else {
+                        indirect[i - NR_DIRECT_BLOCKS] = phy_block_nr[i];
+                        indirect_dirty = 1;
+                }
+        }
+        for (i = 0; i < MAX_FILE_BLOCKS; i += nr) {
+                char *data = in->i_da_data + i * BLOCK_SIZE;
+
+                nr = 1;
+                if (!in->i_da_valid[i])
+                        continue;
+                while (i + nr < MAX_FILE_BLOCKS && in->i_da_valid[i + nr] &&
+                       phy_block_nr[i + nr] == phy_block_nr[i] + nr)
+                        nr++;
+                write_data_blocks(in->sb, data, phy_block_nr[i], nr);
+                testfs_put_csums(in->sb, phy_block_nr[i], data, nr);
+        }
+        if (indirect_dirty) {
+                write_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        }
+        bzero(in->i_da_valid, sizeof(in->i_da_valid));
+        in->i_da_nr = 0;
+        pthread_mutex_lock(&in->sb->inode_lock);
+        list_del(&in->i_da_list);
+        pthread_mutex_unlock(&in->sb->inode_lock);
+        free(in->i_da_data);
+        in->i_da_data = NULL;
+        in->i_flags |= I_FLAGS_DIRTY;
+}
+
 struct inode *
 testfs_get_inode(struct super_block *sb, int inode_nr)
 {
@@ -184,9 +475,19 @@ testfs_get_inode(struct super_block *sb, int inode_nr)
         int block_offset;
         struct inode *in;
 
+        /* cached inodes are found without taking sb->inode_lock */
+        rcu_read_lock();
+        in = inode_hash_find(sb, inode_nr);
+        if (in && !inode_get_unless_zero(in))
+                in = NULL;
+        rcu_read_unlock();
+        if (in)
+                return in;
+        pthread_mutex_lock(&sb->inode_lock);
         in = inode_hash_find(sb, inode_nr);
         if (in) {
-                in->i_count++;
+                __atomic_add_fetch(&in->i_count, 1, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&sb->inode_lock);
                 return in;
         }
         if ((in = calloc(1, sizeof(struct inode))) == NULL) {
@@ -196,13 +497,30 @@ testfs_get_inode(struct super_block *sb, int inode_nr)
         in->i_nr = inode_nr;
         in->sb = sb;
         in->i_count = 1;
+        pthread_rwlock_init(&in->i_rwlock, NULL);
         testfs_read_inode_block(in, block);
         block_offset = testfs_inode_to_block_offset(in);
         memcpy(&in->in, block + block_offset, sizeof(struct dinode));
         inode_hash_insert(in);
+        pthread_mutex_unlock(&sb->inode_lock);
         return in;
 }
 
+/* start reading the dinode of inode_nr, unless it is cached */
+void
+testfs_prefetch_inode(struct super_block *sb, int inode_nr)
+{
+        struct inode *in;
+
+        rcu_read_lock();
+        in = inode_hash_find(sb, inode_nr);
+        rcu_read_unlock();
+        if (in)
+                return;
+        prefetch_blocks(sb, sb->sb.inode_blocks_start + 
+                        inode_nr / INODES_PER_BLOCK, 1);
+}
+
 void
 testfs_sync_inode(struct inode *in)
 {
@@ -210,21 +528,89 @@ testfs_sync_inode(struct inode *in)
         int block_offset;
 
         assert(in->i_flags & I_FLAGS_DIRTY);
+        /* other inodes in the block are written by other threads */
+        pthread_mutex_lock(&in->sb->inode_lock);
         testfs_read_inode_block(in, block);
         block_offset = testfs_inode_to_block_offset(in);
         memcpy(block + block_offset, &in->in, sizeof(struct dinode));
         testfs_write_inode_block(in, block);
+        pthread_mutex_unlock(&in->sb->inode_lock);
         in->i_flags &= ~I_FLAGS_DIRTY;
 }
 
+/* called with sb->inode_lock held */
+static void
+testfs_put_inode_locked(struct inode *in)
+{
+        if (__atomic_sub_fetch(&in->i_count, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+        /* other holders may still be changing it otherwise */
+        assert((in->i_flags & I_FLAGS_DIRTY) == 0);
+        if (in->i_da_nr == 0) {
+                testfs_free_inode(in);
+        }
+}
+
 void
 testfs_put_inode(struct inode *in)
 {
-        assert((in->i_flags & I_FLAGS_DIRTY) == 0);
-        if (--in->i_count == 0) {
-                inode_hash_remove(in);
-                free(in);
+        struct super_block *sb = in->sb;
+
+        pthread_mutex_lock(&sb->inode_lock);
+        testfs_put_inode_locked(in);
+        pthread_mutex_unlock(&sb->inode_lock);
+        rcu_reclaim();
+}
+
+/* write out the delayed blocks of the inodes on sb->da_inodes. self, if
+ * not NULL, is locked by the caller. the other inodes are skipped when
+ * self is not NULL and they are locked, since their holders may wait for
+ * self. */
+static void
+testfs_flush_da_inodes(struct super_block *sb, struct inode *self)
+{
+        struct inode **inodes, *in;
+        int i, nr = 0;
+
+        pthread_mutex_lock(&sb->inode_lock);
+        list_for_each_entry(in, &sb->da_inodes, i_da_list) {
+                nr++;
+        }
+        if ((inodes = malloc(nr * sizeof(struct inode *))) == NULL) {
+                EXIT("malloc");
+        }
+        nr = 0;
+        list_for_each_entry(in, &sb->da_inodes, i_da_list) {
+                __atomic_add_fetch(&in->i_count, 1, __ATOMIC_RELAXED);
+                inodes[nr++] = in;
+        }
+        pthread_mutex_unlock(&sb->inode_lock);
+        for (i = 0; i < nr; i++) {
+                in = inodes[i];
+                if (in != self) {
+                        if (!self)
+                                testfs_inode_wrlock(in);
+                        else if (pthread_rwlock_trywrlock(&in->i_rwlock) != 0)
+                                goto put;
+                }
+                if (in->i_da_nr > 0) {
+                        testfs_da_flush(in);
+                        testfs_sync_inode(in);
+                }
+                if (in != self)
+                        testfs_inode_unlock(in);
+put:
+                testfs_put_inode(in);
         }
+        free(inodes);
+}
+
+/* write out the delayed blocks of all inodes. no inode may be locked by
+ * the caller. */
+void
+testfs_flush_inodes(struct super_block *sb)
+{
+        testfs_flush_da_inodes(sb, NULL);
 }
 
 int
@@ -245,76 +631,263 @@ testfs_inode_get_nr(struct inode *in)
         return in->i_nr;
 }
 
+struct dir_index *
+testfs_inode_get_dir_index(struct inode *in)
+{
+        return in->i_dir_index;
+}
+
+void
+testfs_inode_set_dir_index(struct inode *in, struct dir_index *index)
+{
+        in->i_dir_index = index;
+}
+
+/* returns the cached parent of directory in and sets *namep to the name of
+ * in, or returns NULL if they are not cached */
+struct inode *
+testfs_inode_get_parent(struct inode *in, const char **namep)
+{
+        struct inode *parent;
+
+        pthread_mutex_lock(&in->sb->inode_lock);
+        *namep = in->i_name;
+        parent = in->i_parent;
+        pthread_mutex_unlock(&in->sb->inode_lock);
+        return parent;
+}
+
+/* caches the parent of directory in, unless it is cached already */
+void
+testfs_inode_set_parent(struct inode *in, struct inode *parent, 
+                        const char *name)
+{
+        assert(in->in.i_type == I_DIR && parent->in.i_type == I_DIR);
+        pthread_mutex_lock(&in->sb->inode_lock);
+        if (!in->i_parent) {
+                if ((in->i_name = strdup(name)) == NULL) {
+                        EXIT("strdup");
+                }
+                in->i_parent = parent;
+                __atomic_add_fetch(&parent->i_count, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&in->sb->inode_lock);
+}
+
+int
+testfs_inode_is_inline(struct inode *in)
+{
+        return (in->in.i_dflags & DI_FLAGS_INLINE) != 0;
+}
+
+int
+testfs_inode_is_dirty(struct inode *in)
+{
+        return (in->i_flags & I_FLAGS_DIRTY) != 0;
+}
+
 struct super_block *
 testfs_inode_get_sb(struct inode *in)
 {
         return in->sb;
 }
 
-/* returns negative value on error */
+/* creates an inode in directory dir, or the root if dir is NULL. the
+ * inode is returned write locked. files are created in the group of dir,
+ * and directories in a group chosen to spread them.
+ * returns negative value on error */
 int
-testfs_create_inode(struct super_block *sb, inode_type type, struct inode **inp)
+testfs_create_inode(struct super_block *sb, struct inode *dir, 
+                    inode_type type, struct inode **inp)
 {
         struct inode *in;
-        int inode_nr = testfs_get_inode_freemap(sb);
+        int inode_nr;
 
+        if (!dir)
+                inode_nr = testfs_get_inode_freemap(sb, 0);
+        else if (type == I_DIR)
+                inode_nr = testfs_get_inode_freemap(sb, testfs_dir_group(sb));
+        else
+                inode_nr = testfs_get_inode_freemap(sb, 
+                                                    testfs_inode_group(dir));
         if (inode_nr < 0) {
                 return inode_nr;
         }
         in = testfs_get_inode(sb, inode_nr);
+        testfs_inode_wrlock(in);
         in->in.i_type = type;
+        /* new files and directories start with their data in the inode */
+        in->in.i_dflags = DI_FLAGS_INLINE;
         in->i_flags |= I_FLAGS_DIRTY;
         *inp = in;
         return 0;
 }
 
+/* removes in, which the caller has write locked, and unlocks and puts
+ * it. the names cached in a removed directory are forgotten, since its
+ * inode number may be reused. */
 void
 testfs_remove_inode(struct inode *in)
 {
+        if (in->in.i_type == I_DIR)
+                dcache_purge(in->sb, in->i_nr);
+        pthread_mutex_lock(&in->sb->inode_lock);
+        if (in->i_parent) {
+                testfs_put_inode_locked(in->i_parent);
+                in->i_parent = NULL;
+        }
+        pthread_mutex_unlock(&in->sb->inode_lock);
         testfs_truncate_data(in, 0);
         /* zero the inode */
         bzero(&in->in, sizeof(struct dinode));
         in->i_flags |= I_FLAGS_DIRTY;
-        testfs_put_inode_freemap(in->sb, in->i_nr);
         testfs_sync_inode(in);
+        /* threads that still hold in see it zeroed. the inode number gets
+         * a new inode once it is reused. */
+        pthread_mutex_lock(&in->sb->inode_lock);
+        inode_hash_remove(in);
+        in->i_flags |= I_FLAGS_REMOVED;
+        pthread_mutex_unlock(&in->sb->inode_lock);
+        testfs_put_inode_freemap(in->sb, in->i_nr);
+        testfs_inode_unlock(in);
         testfs_put_inode(in);
 }
 
 /* read data from inode in, from start to start+size, into buf[size].
+ * runs of whole blocks that are physically contiguous are read with a
+ * single read_blocks directly into buf. holes read as zeros.
  * return 0 on success.
  * return negative value on error. */
 int
 testfs_read_data(struct inode *in, int start, char *buf, const int size)
 {
         char block[BLOCK_SIZE];
+        int indirect[NR_INDIRECT_BLOCKS];
+        int log_block_nr = start / BLOCK_SIZE;
         int b_offset = start % BLOCK_SIZE; /* src offset in block for copy */
         int buf_offset = 0; /* dst offset in buf for copy */
-        int done = 0;
         
         assert(buf);
         assert((start + size) <= in->in.i_size);
-        do {
-                int block_nr = (start + buf_offset)/BLOCK_SIZE;
+        if (in->in.i_dflags & DI_FLAGS_INLINE) {
+                memcpy(buf, in->in.i_inline + start, size);
+                return 0;
+        }
+        if (in->in.i_indirect &&
+            DIVROUNDUP(start + size, BLOCK_SIZE) > NR_DIRECT_BLOCKS) {
+                read_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        }
+        while (buf_offset < size) {
+                int phy_block_nr;
                 int copy_size;
 
-                block_nr = testfs_get_block(in, block, block_nr);
-                if (block_nr < 0)
-                        return block_nr;
-                assert(block_nr > 0);
-                if ((size - buf_offset) <= (BLOCK_SIZE - b_offset)) {
-                        copy_size = size - buf_offset;
-                        done = 1;
-                } else {
-                        copy_size = BLOCK_SIZE - b_offset;
+                phy_block_nr = testfs_map_block(in, indirect, log_block_nr);
+                if (phy_block_nr < 0)
+                        return phy_block_nr;
+                copy_size = MIN(size - buf_offset, BLOCK_SIZE - b_offset);
+                if (phy_block_nr == 0 && testfs_da_read(in, log_block_nr, 
+                        b_offset, buf + buf_offset, copy_size)) {
+                        goto next;
+                }
+                if (phy_block_nr == 0 || 
+                    testfs_is_unwritten(in, log_block_nr)) {
+                        /* holes and preallocated blocks read as zeros */
+                        bzero(buf + buf_offset, copy_size);
+                        goto next;
                 }
+                if (b_offset == 0 && (size - buf_offset) >= BLOCK_SIZE) {
+                        int nr = 1;
+
+                        while ((size - buf_offset) >= (nr + 1) * BLOCK_SIZE &&
+                               testfs_map_block(in, indirect, log_block_nr + nr)
+                               == phy_block_nr + nr &&
+                               !testfs_is_unwritten(in, log_block_nr + nr))
+                                nr++;
+                        read_blocks(in->sb, buf + buf_offset, phy_block_nr, nr);
+                        buf_offset += nr * BLOCK_SIZE;
+                        log_block_nr += nr;
+                        continue;
+                }
+                read_blocks(in->sb, block, phy_block_nr, 1);
                 memcpy(buf + buf_offset, block + b_offset, copy_size);
+next:
                 buf_offset += copy_size;
                 b_offset = 0;
-        } while (!done);
+                log_block_nr++;
+        }
         return 0;
 }
 
+/* return a pointer to the data of inode in at offset start. inline data is
+ * returned in place, otherwise the block holding start is read into 
+ * block[BLOCK_SIZE]. *len receives the number of bytes of file data at the
+ * returned pointer. the pointer is valid until in is modified or block is
+ * reused.
+ * returns NULL on error. */
+char *
+testfs_map_data(struct inode *in, int start, char *block, int *len)
+{
+        int b_start = start - (start % BLOCK_SIZE);
+
+        assert(start >= 0 && start < in->in.i_size);
+        if (in->in.i_dflags & DI_FLAGS_INLINE) {
+                *len = in->in.i_size - start;
+                return in->in.i_inline + start;
+        }
+        *len = MIN(BLOCK_SIZE, in->in.i_size - b_start);
+        if (testfs_read_data(in, b_start, block, *len) < 0)
+                return NULL;
+        *len -= start - b_start;
+        return block + (start - b_start);
+}
+
+/* move the inline data of in out to data blocks.
+ * returns negative value on error. */
+static int
+testfs_inline_to_blocks(struct inode *in)
+{
+        char data[INLINE_DATA_SIZE];
+        int size = in->in.i_size;
+        int ret;
+
+        assert(in->in.i_dflags & DI_FLAGS_INLINE);
+        memcpy(data, in->in.i_inline, size);
+        bzero(in->in.i_inline, INLINE_DATA_SIZE);
+        in->in.i_dflags &= ~DI_FLAGS_INLINE;
+        in->in.i_size = 0;
+        in->i_flags |= I_FLAGS_DIRTY;
+        ret = testfs_write_data(in, 0, data, size);
+        if (ret < 0) { /* the blocks have been truncated, stay inline */
+                in->in.i_dflags |= DI_FLAGS_INLINE;
+                memcpy(in->in.i_inline, data, size);
+                in->in.i_size = size;
+        }
+        return ret;
+}
+
+/* the block at the end of file may hold stale data past i_size. zero it,
+ * up to end, before the file is extended beyond i_size.
+ * returns negative value on error. */
+static int
+testfs_zero_past_eof(struct inode *in, int end)
+{
+        char zero[BLOCK_SIZE] = {0};
+        int nr;
+
+        if (end <= in->in.i_size || (in->in.i_size % BLOCK_SIZE) == 0 ||
+            (in->in.i_dflags & DI_FLAGS_INLINE))
+                return 0;
+        nr = MIN(end, ROUNDUP(in->in.i_size, BLOCK_SIZE)) - in->in.i_size;
+        return testfs_write_data(in, in->in.i_size, zero, nr);
+}
+
 /* write data from buf[size] to inode in, from start to start+size.
+ * blocks that are overwritten entirely are not read first, and runs of
+ * them that are physically contiguous are written with a single
+ * write_blocks directly from buf. in delayed allocation mode, file blocks
+ * that have no physical block yet are buffered in the inode instead. data
+ * that fits in the inode stays inline until the file outgrows it. writing
+ * past the end of the file leaves the blocks in between unmapped.
  * return 0 on success.
  * return negative value on error. */
 /* TODO: on error, unallocate blocks */
@@ -322,39 +895,110 @@ int
 testfs_write_data(struct inode *in, int start, char *buf, const int size)
 {
         char block[BLOCK_SIZE];
+        int indirect[NR_INDIRECT_BLOCKS];
+        int indirect_dirty = 0;
+        int log_block_nr = start / BLOCK_SIZE;
         int b_offset = start % BLOCK_SIZE;  /* dst offset in block for copy */
         int buf_offset = 0; /* src offset in buf for copy */
-        int done = 0;
+        int delalloc = in->sb->delalloc && (in->in.i_type == I_FILE);
+        int orig_size = in->in.i_size;
+        int ret = 0;
         
         assert(buf);
-        assert(start <= in->in.i_size);
-        do {
-                int block_nr = (start + buf_offset)/BLOCK_SIZE;
-                int copy_size;
-                int csum;
-
-                block_nr = testfs_allocate_block(in, block, block_nr);
-                if (block_nr < 0) {
-                        int orig_size = in->in.i_size;
-                        in->in.i_size = MAX(orig_size, start + buf_offset);
+        assert(start >= 0);
+        if (in->in.i_dflags & DI_FLAGS_INLINE) {
+                if (start + size <= INLINE_DATA_SIZE) {
+                        memcpy(in->in.i_inline + start, buf, size);
+                        in->in.i_size = MAX(in->in.i_size, start + size);
                         in->i_flags |= I_FLAGS_DIRTY;
-                        testfs_truncate_data(in, orig_size);
-                        return block_nr;
+                        return 0;
                 }
-                assert(block_nr > 0);
-                if ((size - buf_offset) <= (BLOCK_SIZE - b_offset)) {
-                        copy_size = size - buf_offset;
-                        done = 1;
-                } else {
-                        copy_size = BLOCK_SIZE - b_offset;
+                if ((ret = testfs_inline_to_blocks(in)) < 0)
+                        return ret;
+        }
+        if ((ret = testfs_zero_past_eof(in, start)) < 0)
+                return ret;
+        /* a hint, read without alloc_lock */
+        if (delalloc && 
+            __atomic_load_n(&in->sb->nr_reserved_blocks, __ATOMIC_RELAXED) >=
+            DA_MAX_RESERVED_BLOCKS) {
+                testfs_flush_da_inodes(in->sb, in);
+        }
+        if (in->in.i_indirect &&
+            DIVROUNDUP(start + size, BLOCK_SIZE) > NR_DIRECT_BLOCKS) {
+                read_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        }
+        while (buf_offset < size) {
+                int phy_block_nr;
+                int copy_size = MIN(size - buf_offset, BLOCK_SIZE - b_offset);
+
+                if (delalloc && 
+                    testfs_map_block(in, indirect, log_block_nr) == 0) {
+                        ret = testfs_da_write(in, log_block_nr, b_offset,
+                                              buf + buf_offset, copy_size);
+                        if (ret < 0)
+                                break;
+                        goto next;
+                }
+                if (b_offset == 0 && (size - buf_offset) >= BLOCK_SIZE) {
+                        int nr = 1;
+
+                        phy_block_nr = testfs_bmap_alloc(in, indirect,
+                                &indirect_dirty, NULL, log_block_nr);
+                        if (phy_block_nr < 0) {
+                                ret = phy_block_nr;
+                                break;
+                        }
+                        while ((size - buf_offset) >= (nr + 1) * BLOCK_SIZE) {
+                                /* unmapped blocks are delayed instead, and
+                                 * may hold delayed data already */
+                                if (delalloc && testfs_map_block(in, indirect,
+                                        log_block_nr + nr) == 0)
+                                        break;
+                                ret = testfs_bmap_alloc(in, indirect,
+                                        &indirect_dirty, NULL, 
+                                        log_block_nr + nr);
+                                if (ret != phy_block_nr + nr)
+                                        break;
+                                nr++;
+                        }
+                        testfs_write_data_blocks(in, buf + buf_offset, 
+                                                 phy_block_nr, nr);
+                        testfs_put_csums(in->sb, phy_block_nr, 
+                                         buf + buf_offset, nr);
+                        testfs_clear_unwritten(in, log_block_nr, nr);
+                        buf_offset += nr * BLOCK_SIZE;
+                        log_block_nr += nr;
+                        if (ret < 0)
+                                break;
+                        ret = 0;
+                        continue;
+                }
+                phy_block_nr = testfs_bmap_alloc(in, indirect, &indirect_dirty,
+                                                 block, log_block_nr);
+                if (phy_block_nr < 0) {
+                        ret = phy_block_nr;
+                        break;
                 }
+                assert(phy_block_nr > 0);
                 memcpy(block + b_offset, buf + buf_offset, copy_size);
-                csum = testfs_calculate_csum(block, BLOCK_SIZE);
-                write_blocks(in->sb, block, block_nr, 1);
-                testfs_put_csum(in->sb, block_nr, csum);
+                testfs_write_data_blocks(in, block, phy_block_nr, 1);
+                testfs_put_csums(in->sb, phy_block_nr, block, 1);
+                testfs_clear_unwritten(in, log_block_nr, 1);
+next:
                 buf_offset += copy_size;
                 b_offset = 0;
-        } while (!done);
+                log_block_nr++;
+        }
+        if (indirect_dirty) {
+                write_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        }
+        if (ret < 0) {
+                in->in.i_size = MAX(in->in.i_size, start + buf_offset);
+                in->i_flags |= I_FLAGS_DIRTY;
+                testfs_truncate_data(in, orig_size);
+                return ret;
+        }
         in->in.i_size = MAX(in->in.i_size, start + size);
         in->i_flags |= I_FLAGS_DIRTY;
         return 0;
@@ -369,12 +1013,20 @@ testfs_truncate_data(struct inode *in, const int size)
 
         if (in->in.i_size <= size)
                 return;
+        if (in->in.i_dflags & DI_FLAGS_INLINE) {
+                bzero(in->in.i_inline + size, in->in.i_size - size);
+                in->in.i_size = size;
+                in->i_flags |= I_FLAGS_DIRTY;
+                return;
+        }
         s_block_nr = DIVROUNDUP(size, BLOCK_SIZE);
         e_block_nr = DIVROUNDUP(in->in.i_size, BLOCK_SIZE);
+        testfs_clear_unwritten(in, s_block_nr, e_block_nr - s_block_nr);
 
         /* remove direct blocks */
         for (i = s_block_nr; i < e_block_nr && i < NR_DIRECT_BLOCKS; i++) {
-                assert(in->in.i_block_nr[i] > 0);
+                if (testfs_da_forget(in, i) || in->in.i_block_nr[i] == 0)
+                        continue;
                 testfs_free_block(in->sb, in->in.i_block_nr[i]);
                 in->in.i_block_nr[i] = 0;
                 in->i_flags |= I_FLAGS_DIRTY;
@@ -383,14 +1035,20 @@ testfs_truncate_data(struct inode *in, const int size)
         s_block_nr = MAX(s_block_nr, 0);
         e_block_nr -= NR_DIRECT_BLOCKS;
 
-        if (e_block_nr > 0) { /* remove indirect blocks */
+        if (e_block_nr > 0 && in->in.i_indirect == 0) {
+                /* only holes or delayed blocks, no indirect block yet */
+                for (i = s_block_nr; i < e_block_nr; i++) {
+                        testfs_da_forget(in, i + NR_DIRECT_BLOCKS);
+                }
+        } else if (e_block_nr > 0) { /* remove indirect blocks */
                 char block[BLOCK_SIZE];
-                assert(in->in.i_indirect > 0);
                 read_blocks(in->sb, block, in->in.i_indirect, 1);
                 for (i = s_block_nr; i < e_block_nr && i < NR_INDIRECT_BLOCKS;
                      i++) {
                         int block_nr = ((int *)block)[i];
-                        assert(block_nr > 0);
+                        if (testfs_da_forget(in, i + NR_DIRECT_BLOCKS) ||
+                            block_nr == 0)
+                                continue;
                         testfs_free_block(in->sb, block_nr);
                         ((int *)block)[i] = 0;
                 }
@@ -408,22 +1066,111 @@ testfs_truncate_data(struct inode *in, const int size)
         in->i_flags |= I_FLAGS_DIRTY;
 }
 
+/* preallocate the blocks of inode in from start to start+size, extending
+ * the file if needed. the blocks are allocated contiguously when possible
+ * and read as zeros until they are written.
+ * return 0 on success.
+ * return negative value on error. */
+int
+testfs_prealloc_data(struct inode *in, int start, const int size)
+{
+        int indirect[NR_INDIRECT_BLOCKS];
+        int indirect_dirty = 0;
+        int s_block_nr = start / BLOCK_SIZE;
+        int e_block_nr = DIVROUNDUP(start + size, BLOCK_SIZE);
+        int i, nr = 0, needed, phy_block_nr;
+        int ret = 0;
+
+        assert(start >= 0 && size >= 0);
+        if (e_block_nr > MAX_FILE_BLOCKS) {
+                ret = -EFBIG;
+                goto out;
+        }
+        if (in->in.i_dflags & DI_FLAGS_INLINE) {
+                if (start + size <= INLINE_DATA_SIZE)
+                        goto out;
+                if ((ret = testfs_inline_to_blocks(in)) < 0)
+                        goto out;
+        }
+        if ((ret = testfs_zero_past_eof(in, start + size)) < 0)
+                goto out;
+        if (in->in.i_indirect)
+                read_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        for (i = s_block_nr; i < e_block_nr; i++) {
+                if (testfs_map_block(in, indirect, i) == 0 && 
+                    !in->i_da_valid[i])
+                        nr++;
+        }
+        if (nr == 0)
+                goto out;
+        needed = nr + (in->in.i_indirect == 0 && e_block_nr > NR_DIRECT_BLOCKS);
+        /* check for space up front, so that the allocations below succeed */
+        if ((ret = testfs_reserve_blocks(in->sb, needed)) < 0)
+                goto out;
+        testfs_reserve_blocks(in->sb, -needed);
+        if (in->in.i_indirect == 0 && e_block_nr > NR_DIRECT_BLOCKS) {
+                in->in.i_indirect = testfs_alloc_block(in->sb, 
+                        testfs_inode_group(in), (char *)indirect);
+                assert(in->in.i_indirect > 0);
+                in->i_flags |= I_FLAGS_DIRTY;
+                indirect_dirty = 1;
+        }
+        phy_block_nr = testfs_alloc_blocks(in->sb, testfs_inode_group(in), 
+                                           nr);
+        for (i = s_block_nr; i < e_block_nr; i++) {
+                int block_nr;
+
+                if (testfs_map_block(in, indirect, i) != 0 || 
+                    in->i_da_valid[i])
+                        continue;
+                if (phy_block_nr > 0) {
+                        block_nr = phy_block_nr++;
+                } else { /* no contiguous range left */
+                        block_nr = testfs_alloc_block(in->sb, 
+                                testfs_inode_group(in), NULL);
+                        assert(block_nr > 0);
+                }
+                if (i < NR_DIRECT_BLOCKS) {
+                        in->in.i_block_nr[i] = block_nr;
+                } else {
+                        indirect[i - NR_DIRECT_BLOCKS] = block_nr;
+                        indirect_dirty = 1;
+                }
+                in->in.i_unwritten |= (1 << i);
+        }
+        if (indirect_dirty) {
+                write_blocks(in->sb, (char *)indirect, in->in.i_indirect, 1);
+        }
+out:
+        if (ret == 0)
+                in->in.i_size = MAX(in->in.i_size, start + size);
+        in->i_flags |= I_FLAGS_DIRTY;
+        return ret;
+}
+
+/* mark the blocks of in in b_freemap and verify their checksums.
+ * returns the number of bytes in mapped blocks, holes excluded. */
 int
 testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
                    struct inode *in)
 {
+        int nr_blocks = DIVROUNDUP(in->in.i_size, BLOCK_SIZE);
         int size = 0;
         int i;
         char block[BLOCK_SIZE];
 
+        if (in->in.i_dflags & DI_FLAGS_INLINE)
+                return size;
         for (i = 0; i < NR_DIRECT_BLOCKS; i++) {
                 int block_nr = in->in.i_block_nr[i];
                 if (block_nr == 0)
-                        return size;
+                        continue;
+                assert(i < nr_blocks);
                 size += BLOCK_SIZE;
                 
-                /* verify checksum */
-                testfs_verify_csum(sb, block_nr);
+                /* verify checksum, preallocated blocks have none */
+                if (!testfs_is_unwritten(in, i))
+                        testfs_verify_csum(sb, block_nr);
                 
                 /* mark block freemap */
                 block_nr -= sb->sb.data_blocks_start;
@@ -437,7 +1184,8 @@ testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
         for (i = 0; i < NR_INDIRECT_BLOCKS; i++) {
                 int block_nr = ((int *)block)[i];
                 if (block_nr == 0)
-                        return size;
+                        continue;
+                assert(NR_DIRECT_BLOCKS + i < nr_blocks);
                 size += BLOCK_SIZE;
                 block_nr -= sb->sb.data_blocks_start;
                 bitmap_mark(b_freemap, block_nr);
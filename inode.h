@@ -8,32 +8,61 @@ typedef enum {I_NONE, I_FILE, I_DIR} inode_type;
 
 #define NR_DIRECT_BLOCKS 4
 #define NR_INDIRECT_BLOCKS (BLOCK_SIZE/sizeof(int))
+#define MAX_FILE_BLOCKS (NR_DIRECT_BLOCKS + NR_INDIRECT_BLOCKS)
+
+/* dinode flags */
+#define DI_FLAGS_INLINE   0x1   /* data is stored in i_inline */
+
+#define INLINE_DATA_SIZE 48
 
 struct dinode {
         inode_type i_type;                      /* 0x00 */
         int i_size;                             /* 0x04 */
         int i_mod_time;                         /* 0x08 */
-        int i_block_nr[NR_DIRECT_BLOCKS];       /* 0x0C */
-        int i_indirect;                         /* 0x1C */
+        int i_dflags;                           /* 0x0C */
+        union {
+                struct {
+                        int i_block_nr[NR_DIRECT_BLOCKS]; /* 0x10 */
+                        int i_indirect;                   /* 0x20 */
+                        int i_unwritten;                  /* 0x24 */
+                };
+                char i_inline[INLINE_DATA_SIZE];          /* 0x10 */
+        };
 };
 
 #define INODES_PER_BLOCK (BLOCK_SIZE/(sizeof(struct dinode)))
 
-void inode_hash_init(void);
-void inode_hash_destroy(void);
+struct dir_index;
+
+void inode_hash_init(struct super_block *sb);
+void inode_hash_destroy(struct super_block *sb);
 struct inode *testfs_get_inode(struct super_block *sb, int inode_nr);
+void testfs_prefetch_inode(struct super_block *sb, int inode_nr);
 void testfs_sync_inode(struct inode *in);
 void testfs_put_inode(struct inode *in);
+void testfs_inode_rdlock(struct inode *in);
+void testfs_inode_wrlock(struct inode *in);
+void testfs_inode_unlock(struct inode *in);
+void testfs_flush_inodes(struct super_block *sb);
 int testfs_inode_get_size(struct inode *in);
 inode_type testfs_inode_get_type(struct inode *in);
+int testfs_inode_is_inline(struct inode *in);
+int testfs_inode_is_dirty(struct inode *in);
 int testfs_inode_get_nr(struct inode *in);
 struct super_block *testfs_inode_get_sb(struct inode *in);
-int testfs_create_inode(struct super_block *sb, inode_type type,
-                        struct inode **inp);
+struct dir_index *testfs_inode_get_dir_index(struct inode *in);
+void testfs_inode_set_dir_index(struct inode *in, struct dir_index *index);
+struct inode *testfs_inode_get_parent(struct inode *in, const char **namep);
+void testfs_inode_set_parent(struct inode *in, struct inode *parent, 
+                             const char *name);
+int testfs_create_inode(struct super_block *sb, struct inode *dir, 
+                        inode_type type, struct inode **inp);
 void testfs_remove_inode(struct inode *in);
 int testfs_read_data(struct inode *in, int start, char *buf, const int size);
+char *testfs_map_data(struct inode *in, int start, char *block, int *len);
 int testfs_write_data(struct inode *in, int start, char *name, const int size);
 void testfs_truncate_data(struct inode *in, const int size);
+int testfs_prealloc_data(struct inode *in, int start, const int size);
 int testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
                        struct inode *in);
 
@@ -0,0 +1,982 @@
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+#include "testfs.h"
+#include "super.h"
+#include "block.h"
+#include "csum.h"
+#include "bitmap.h"
+#include "list.h"
+#include "discard.h"
+#include "journal.h"
+
+/* blocks written while a transaction runs are kept in memory. a committed
+ * transaction joins the current group of transactions, and the group is
+ * appended to the log as one record, with a single write, by the commit
+ * thread. the group is logged when it is commit_interval ms old, or right
+ * away when it has grown to JOURNAL_GROUP_BLOCKS blocks, so that back to
+ * back transactions share one device write, and a transaction waits at
+ * most commit_interval ms to become durable.
+ *
+ * logged blocks stay in memory until they are checkpointed, i.e., written
+ * in place. reads see the blocks of the journal instead of the stale
+ * blocks in place.
+ *
+ * the log is circular. records are appended at its head, and wrap to its
+ * start when they do not fit before its end. the checkpoint thread writes
+ * the logged blocks in place, in block order, once the log is half full,
+ * and then moves the tail of the log past the checkpointed records. the
+ * journal superblock records the tail, and the sequence number of the
+ * record there, so that the older records are not replayed. a record is
+ * only made to wait for the checkpoint thread when the log has no room
+ * for it.
+ *
+ * the log is also checkpointed at unmount, and before a block waiting to
+ * be checkpointed is written outside a transaction.
+ *
+ * the transactions of all threads share the running set, which is
+ * committed when the last of them ends. once the running set has grown to
+ * JOURNAL_GROUP_BLOCKS blocks, new transactions wait for it to be
+ * committed, so that it cannot be kept open forever.
+ *
+ * in ordered mode, file data is not journaled. a data block that the
+ * running transaction has allocated is written in place right away, and
+ * so before the metadata that points to it is logged. other data blocks
+ * are journaled as in data mode: overwriting a block that committed
+ * metadata points to would not be atomic with its checksum, a block with
+ * a version in the journal would be overwritten by checkpoint or replay,
+ * and a block whose free has not been logged may still belong to another
+ * file after a crash. */
+
+#define JOURNAL_HASH_SHIFT 6
+
+/* a group is logged right away once it has this many blocks */
+#define JOURNAL_GROUP_BLOCKS (JOURNAL_SIZE / 4)
+
+/* the log is checkpointed in the background once it has this many blocks */
+#define JOURNAL_CHECKPOINT_BLOCKS (JOURNAL_SIZE / 2)
+
+/* data blocks tracked in ordered mode */
+#define JOURNAL_NR_DATA_BLOCKS (BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD)
+
+struct jblock {
+        struct hlist_node hnode;
+        struct list_head list;
+        int nr;                         /* home block number */
+        char data[BLOCK_SIZE];
+};
+
+/* a set of blocks, by home block number */
+struct jset {
+        struct hlist_head table[1 << JOURNAL_HASH_SHIFT];
+        struct list_head blocks;        /* in the order they were added */
+        int nr;
+};
+
+/* all fields are protected by lock */
+struct journal {
+        int head;                       /* next free block in the log */
+        int tail;                       /* oldest record in the log */
+        int seq;                        /* of the next record */
+        int mode;
+        int tx;                         /* id of the running tx */
+        int group_tx;                   /* last tx in the group */
+        int logging_tx;                 /* last tx being logged */
+        int logged_tx;                  /* last tx logged */
+        int *alloc_tx;                  /* tx that allocated a data block */
+        int *free_tx;                   /* tx that freed a data block */
+        struct bitmap *discard;         /* freed blocks to discard once
+                                         * their free is logged */
+        int nr_discard;
+        struct jset running;            /* written by the running tx */
+        struct jset group;              /* committed, not logged yet */
+        struct jset logging;            /* being logged */
+        struct jset committed;          /* logged, not checkpointed */
+        struct jset checkpointing;      /* being written in place */
+        int nr_handles;                 /* transactions in running */
+        int closing;                    /* no new transactions join it */
+        int cp_gen;                     /* checkpoints that completed */
+        int flushing;                   /* logging is being written */
+        int cp_running;                 /* checkpointing is being written */
+        int cp_wanted;                  /* a record waits for log space */
+        int commit_interval;            /* ms */
+        struct timespec deadline;       /* when the group is logged */
+        int stop;
+        pthread_t commit_thread;
+        pthread_t checkpoint_thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+};
+
+/* the log starts after the journal superblock */
+#define JOURNAL_LOG_START 1
+
+/* blocks in the record of a transaction of nr blocks */
+#define JOURNAL_RECORD_LEN(nr) \
+        (DIVROUNDUP(nr, JOURNAL_TAGS_PER_BLOCK) + (nr) + 1)
+
+static void
+jset_init(struct jset *set)
+{
+        int i;
+
+        for (i = 0; i < (1 << JOURNAL_HASH_SHIFT); i++) {
+                INIT_HLIST_HEAD(&set->table[i]);
+        }
+        INIT_LIST_HEAD(&set->blocks);
+        set->nr = 0;
+}
+
+static struct jblock *
+jset_find(struct jset *set, int nr)
+{
+        struct hlist_node *elem;
+        struct jblock *jb;
+
+        if (set->nr == 0)
+                return NULL;
+        hlist_for_each_entry(jb, elem,
+                             &set->table[hash_int(nr, JOURNAL_HASH_SHIFT)],
+                             hnode) {
+                if (jb->nr == nr)
+                        return jb;
+        }
+        return NULL;
+}
+
+static void
+jset_add(struct jset *set, struct jblock *jb)
+{
+        hlist_add_head(&jb->hnode,
+                       &set->table[hash_int(jb->nr, JOURNAL_HASH_SHIFT)]);
+        list_add_tail(&jb->list, &set->blocks);
+        set->nr++;
+}
+
+static void
+jset_remove(struct jset *set, struct jblock *jb)
+{
+        hlist_del(&jb->hnode);
+        list_del(&jb->list);
+        set->nr--;
+}
+
+/* moves the blocks of src to dst, where they replace older versions */
+static void
+jset_move(struct jset *dst, struct jset *src)
+{
+        struct jblock *jb, *n;
+
+        list_for_each_entry_safe(jb, n, &src->blocks, list) {
+                struct jblock *old = jset_find(dst, jb->nr);
+
+                if (old) {
+                        jset_remove(dst, old);
+                        free(old);
+                }
+                jset_remove(src, jb);
+                jset_add(dst, jb);
+        }
+}
+
+static void
+jset_free(struct jset *set)
+{
+        struct jblock *jb, *n;
+
+        list_for_each_entry_safe(jb, n, &set->blocks, list) {
+                jset_remove(set, jb);
+                free(jb);
+        }
+}
+
+static int
+jblock_cmp(const void *a, const void *b)
+{
+        return (*(struct jblock **)a)->nr - (*(struct jblock **)b)->nr;
+}
+
+/* writes the blocks of set in place, in block order, with one write for
+ * each run of consecutive blocks */
+static void
+jset_write_sorted(struct super_block *sb, struct jset *set)
+{
+        struct jblock **sorted;
+        struct jblock *jb;
+        char *run;
+        int i = 0, nr;
+
+        if (set->nr == 0)
+                return;
+        if ((sorted = malloc(set->nr * sizeof(struct jblock *))) == NULL ||
+            (run = malloc(set->nr * BLOCK_SIZE)) == NULL) {
+                EXIT("malloc");
+        }
+        list_for_each_entry(jb, &set->blocks, list) {
+                sorted[i++] = jb;
+        }
+        qsort(sorted, set->nr, sizeof(struct jblock *), jblock_cmp);
+        for (i = 0; i < set->nr; i += nr) {
+                for (nr = 0; i + nr < set->nr &&
+                     sorted[i + nr]->nr == sorted[i]->nr + nr; nr++) {
+                        memcpy(run + nr * BLOCK_SIZE, sorted[i + nr]->data,
+                               BLOCK_SIZE);
+                }
+                dev_write_blocks(sb, run, sorted[i]->nr, nr);
+        }
+        free(run);
+        free(sorted);
+}
+
+static void
+testfs_journal_write_super(struct super_block *sb, int seq, int start)
+{
+        char block[BLOCK_SIZE] = {0};
+        struct djournal_super *jsb = (struct djournal_super *)block;
+
+        jsb->magic = JOURNAL_MAGIC;
+        jsb->seq = seq;
+        jsb->start = start;
+        dev_write_blocks(sb, block, sb->sb.journal_start, 1);
+}
+
+void
+testfs_make_journal(struct super_block *sb)
+{
+        zero_blocks(sb, sb->sb.journal_start, JOURNAL_SIZE);
+        testfs_journal_write_super(sb, 1, JOURNAL_LOG_START);
+}
+
+/* parses the record seq at log block pos of the log read in memory,
+ * copying its blocks to data and their home block numbers to tags.
+ * returns the log block after the record, or negative value if there is
+ * no complete record seq at pos. */
+static int
+testfs_journal_parse_record(const char *log, int pos, int seq, char *data,
+                            int *tags, int *nrp)
+{
+        const struct djournal_header *h;
+        const struct djournal_commit *c;
+        int nr = 0;
+
+        /* collect the descriptors and blocks of the record */
+        for (;;) {
+                if (pos >= JOURNAL_SIZE)
+                        return -EINVAL;
+                h = (const struct djournal_header *)(log + pos++ * BLOCK_SIZE);
+                if (h->magic != JOURNAL_MAGIC || h->seq != seq)
+                        return -EINVAL;
+                if (h->type == JOURNAL_COMMIT)
+                        break;
+                if (h->type != JOURNAL_DESCRIPTOR || h->nr <= 0 ||
+                    h->nr > JOURNAL_TAGS_PER_BLOCK ||
+                    pos + h->nr >= JOURNAL_SIZE)
+                        return -EINVAL;
+                memcpy(tags + nr, h + 1, h->nr * sizeof(int));
+                memcpy(data + nr * BLOCK_SIZE, log + pos * BLOCK_SIZE,
+                       h->nr * BLOCK_SIZE);
+                pos += h->nr;
+                nr += h->nr;
+        }
+        /* a torn record ends the log */
+        c = (const struct djournal_commit *)h;
+        if (c->h.nr != nr ||
+            c->csum != testfs_calculate_csum(data, nr * BLOCK_SIZE))
+                return -EINVAL;
+        *nrp = nr;
+        return pos;
+}
+
+/* applies the records in the log, from record seq at log block start on.
+ * the log is read with one read, and only the newest version of each
+ * block is kept, so that the blocks are written once, in block order.
+ * returns the sequence number that follows the last one applied. */
+static int
+testfs_journal_replay(struct super_block *sb, int seq, int start)
+{
+        char *log = malloc(JOURNAL_SIZE * BLOCK_SIZE);
+        char *data = malloc(JOURNAL_SIZE * BLOCK_SIZE);
+        int *tags = malloc(JOURNAL_SIZE * sizeof(int));
+        struct jset blocks;
+        int pos = start;
+
+        if (!log || !data || !tags) {
+                EXIT("malloc");
+        }
+        jset_init(&blocks);
+        dev_read_blocks(sb, log, sb->sb.journal_start, JOURNAL_SIZE);
+        for (;; seq++) {
+                int next, nr, i;
+
+                next = testfs_journal_parse_record(log, pos, seq, data, tags,
+                                                   &nr);
+                /* the record may have wrapped to the start of the log */
+                if (next < 0 && pos != JOURNAL_LOG_START) {
+                        next = testfs_journal_parse_record(
+                                log, JOURNAL_LOG_START, seq, data, tags, &nr);
+                }
+                if (next < 0)
+                        break;
+                for (i = 0; i < nr; i++) {
+                        struct jblock *jb = jset_find(&blocks, tags[i]);
+
+                        if (!jb) {
+                                jb = malloc(sizeof(struct jblock));
+                                if (!jb) {
+                                        EXIT("malloc");
+                                }
+                                jb->nr = tags[i];
+                                jset_add(&blocks, jb);
+                        }
+                        memcpy(jb->data, data + i * BLOCK_SIZE, BLOCK_SIZE);
+                }
+                pos = next;
+        }
+        jset_write_sorted(sb, &blocks);
+        jset_free(&blocks);
+        free(tags);
+        free(data);
+        free(log);
+        return seq;
+}
+
+/* returns the log blocks used by records */
+static int
+testfs_journal_used(struct journal *j)
+{
+        if (j->head >= j->tail)
+                return j->head - j->tail;
+        return JOURNAL_SIZE - j->tail + j->head - JOURNAL_LOG_START;
+}
+
+/* returns the log block where a record of len blocks goes, or -1 if the
+ * log has no room for it. called with j->lock held. */
+static int
+testfs_journal_log_pos(struct journal *j, int len)
+{
+        if (j->head == j->tail && !j->cp_running) {
+                /* the log is empty */
+                j->head = j->tail = JOURNAL_LOG_START;
+        }
+        /* the head never catches up with the tail, so that a full log is
+         * not mistaken for an empty one */
+        if (j->head >= j->tail) {
+                if (j->head + len <= JOURNAL_SIZE)
+                        return j->head;
+                if (JOURNAL_LOG_START + len < j->tail)
+                        return JOURNAL_LOG_START;
+        } else if (j->head + len < j->tail) {
+                return j->head;
+        }
+        return -1;
+}
+
+/* writes the records logged so far in place, and frees their log space.
+ * called with j->lock held, which is dropped while the blocks are
+ * written. */
+static void
+testfs_journal_checkpoint_run(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+        int seq, head;
+
+        while (j->cp_running)
+                pthread_cond_wait(&j->cond, &j->lock);
+        j->cp_wanted = 0;
+        if (j->head == j->tail)
+                return;
+        /* a record being logged is at head, with seq */
+        seq = j->seq;
+        head = j->head;
+        jset_move(&j->checkpointing, &j->committed);
+        j->cp_running = 1;
+        pthread_mutex_unlock(&j->lock);
+        jset_write_sorted(sb, &j->checkpointing);
+        testfs_journal_write_super(sb, seq, head);
+        pthread_mutex_lock(&j->lock);
+        jset_free(&j->checkpointing);
+        j->cp_gen++;
+        j->tail = head;
+        j->cp_running = 0;
+        pthread_cond_broadcast(&j->cond);
+}
+
+/* writes the committed blocks in place and empties the log, called with
+ * j->lock held */
+static void
+testfs_journal_checkpoint_locked(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+
+        while (j->flushing)
+                pthread_cond_wait(&j->cond, &j->lock);
+        testfs_journal_checkpoint_run(sb);
+}
+
+/* writes the record of the blocks of set to the log at pos, with one
+ * write */
+static void
+testfs_journal_log(struct super_block *sb, struct jset *set, int seq,
+                   int pos)
+{
+        int nr = set->nr;
+        int len = JOURNAL_RECORD_LEN(nr);
+        struct djournal_header *h = NULL;
+        struct djournal_commit *c;
+        struct jblock *jb;
+        char *buf, *data;
+        int i = 0, b = 0;
+
+        if ((buf = calloc(len, BLOCK_SIZE)) == NULL ||
+            (data = malloc(nr * BLOCK_SIZE)) == NULL) {
+                EXIT("malloc");
+        }
+        list_for_each_entry(jb, &set->blocks, list) {
+                if (i % JOURNAL_TAGS_PER_BLOCK == 0) {
+                        h = (struct djournal_header *)(buf + b++ *
+                                                       BLOCK_SIZE);
+                        h->magic = JOURNAL_MAGIC;
+                        h->type = JOURNAL_DESCRIPTOR;
+                        h->seq = seq;
+                        h->nr = MIN(nr - i, JOURNAL_TAGS_PER_BLOCK);
+                }
+                ((int *)(h + 1))[i % JOURNAL_TAGS_PER_BLOCK] = jb->nr;
+                memcpy(buf + b++ * BLOCK_SIZE, jb->data, BLOCK_SIZE);
+                memcpy(data + i++ * BLOCK_SIZE, jb->data, BLOCK_SIZE);
+        }
+        c = (struct djournal_commit *)(buf + b * BLOCK_SIZE);
+        c->h.magic = JOURNAL_MAGIC;
+        c->h.type = JOURNAL_COMMIT;
+        c->h.seq = seq;
+        c->h.nr = nr;
+        c->csum = testfs_calculate_csum(data, nr * BLOCK_SIZE);
+        dev_write_blocks(sb, buf, sb->sb.journal_start + pos, len);
+        free(data);
+        free(buf);
+}
+
+/* passes the freed blocks whose free has been logged to discard, called
+ * with j->lock held. punching out a block before then would lose its
+ * data if the free is lost in a crash. */
+static void
+testfs_journal_discard_logged(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+        int i;
+
+        for (i = 0; j->nr_discard > 0 && i < JOURNAL_NR_DATA_BLOCKS; i++) {
+                if (!bitmap_isset(j->discard, i) || 
+                    j->free_tx[i] > j->logged_tx)
+                        continue;
+                bitmap_unmark(j->discard, i);
+                j->nr_discard--;
+                if (sb->discard)
+                        testfs_discard_block(sb, 
+                                             sb->sb.data_blocks_start + i);
+        }
+}
+
+/* appends the group to the log, called with j->lock held. the lock is
+ * dropped while the record is written, so that the next group can be
+ * formed in the meantime. */
+static void
+testfs_journal_flush(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+        int len, pos;
+
+        for (;;) {
+                while (j->flushing)
+                        pthread_cond_wait(&j->cond, &j->lock);
+                if (j->group.nr == 0)
+                        return;
+                len = JOURNAL_RECORD_LEN(j->group.nr);
+                if (len > JOURNAL_SIZE - JOURNAL_LOG_START) {
+                        /* the group does not fit in the log. it is written
+                         * in place, which is not atomic. */
+                        testfs_journal_checkpoint_locked(sb);
+                        jset_write_sorted(sb, &j->group);
+                        jset_free(&j->group);
+                        j->logged_tx = j->group_tx;
+                        testfs_journal_discard_logged(sb);
+                        return;
+                }
+                if ((pos = testfs_journal_log_pos(j, len)) >= 0)
+                        break;
+                if (j->stop) {
+                        testfs_journal_checkpoint_run(sb);
+                        continue;
+                }
+                /* wait for the checkpoint thread to free log space */
+                j->cp_wanted = 1;
+                pthread_cond_broadcast(&j->cond);
+                pthread_cond_wait(&j->cond, &j->lock);
+        }
+        jset_move(&j->logging, &j->group);
+        j->logging_tx = j->group_tx;
+        j->flushing = 1;
+        pthread_mutex_unlock(&j->lock);
+        testfs_journal_log(sb, &j->logging, j->seq, pos);
+        pthread_mutex_lock(&j->lock);
+        j->head = pos + len;
+        j->seq++;
+        /* the blocks wait to be checkpointed */
+        jset_move(&j->committed, &j->logging);
+        j->logged_tx = j->logging_tx;
+        testfs_journal_discard_logged(sb);
+        j->flushing = 0;
+        pthread_cond_broadcast(&j->cond);
+}
+
+static int
+timespec_passed(const struct timespec *ts)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec > ts->tv_sec ||
+                (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+/* logs each group when its commit interval has passed */
+static void *
+testfs_journal_commit_thread(void *arg)
+{
+        struct super_block *sb = arg;
+        struct journal *j = sb->journal;
+
+        pthread_mutex_lock(&j->lock);
+        while (!j->stop) {
+                if (j->group.nr == 0 || j->flushing) {
+                        pthread_cond_wait(&j->cond, &j->lock);
+                } else if (!timespec_passed(&j->deadline)) {
+                        pthread_cond_timedwait(&j->cond, &j->lock,
+                                               &j->deadline);
+                } else {
+                        testfs_journal_flush(sb);
+                }
+        }
+        pthread_mutex_unlock(&j->lock);
+        return NULL;
+}
+
+/* checkpoints the log when it is half full, or when a record waits for
+ * log space */
+static void *
+testfs_journal_checkpoint_thread(void *arg)
+{
+        struct super_block *sb = arg;
+        struct journal *j = sb->journal;
+
+        pthread_mutex_lock(&j->lock);
+        while (!j->stop) {
+                if (j->cp_wanted ||
+                    testfs_journal_used(j) >= JOURNAL_CHECKPOINT_BLOCKS) {
+                        testfs_journal_checkpoint_run(sb);
+                } else {
+                        pthread_cond_wait(&j->cond, &j->lock);
+                }
+        }
+        pthread_mutex_unlock(&j->lock);
+        return NULL;
+}
+
+static void
+testfs_journal_stop(struct journal *j)
+{
+        pthread_mutex_lock(&j->lock);
+        j->stop = 1;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* sets up the journal of an image that has one, replaying the
+ * transactions that were not checkpointed, unless the image was unmounted
+ * cleanly, which leaves the log empty.
+ * returns negative value on error. */
+int
+testfs_journal_init(struct super_block *sb, int clean)
+{
+        char block[BLOCK_SIZE];
+        struct djournal_super *jsb = (struct djournal_super *)block;
+        struct journal *j;
+        int start, ret;
+
+        sb->journal = NULL;
+        if (sb->sb.version < TESTFS_VERSION_JOURNAL)
+                return 0;
+        dev_read_blocks(sb, block, sb->sb.journal_start, 1);
+        if (jsb->magic != JOURNAL_MAGIC)
+                return -EINVAL;
+        /* older journals always started at the start of the log */
+        start = jsb->start;
+        if (start < JOURNAL_LOG_START || start >= JOURNAL_SIZE)
+                start = JOURNAL_LOG_START;
+        if ((j = calloc(1, sizeof(struct journal))) == NULL)
+                return -ENOMEM;
+        j->alloc_tx = malloc(JOURNAL_NR_DATA_BLOCKS * sizeof(int));
+        j->free_tx = malloc(JOURNAL_NR_DATA_BLOCKS * sizeof(int));
+        if (!j->alloc_tx || !j->free_tx ||
+            bitmap_create(JOURNAL_NR_DATA_BLOCKS, &j->discard) < 0) {
+                free(j->alloc_tx);
+                free(j->free_tx);
+                free(j);
+                return -ENOMEM;
+        }
+        /* no data block has been allocated or freed by a tx */
+        memset(j->alloc_tx, 0xff, JOURNAL_NR_DATA_BLOCKS * sizeof(int));
+        memset(j->free_tx, 0xff, JOURNAL_NR_DATA_BLOCKS * sizeof(int));
+        j->logged_tx = j->logging_tx = j->group_tx = -1;
+        j->mode = JOURNAL_MODE_ORDERED;
+        j->seq = clean ? jsb->seq : testfs_journal_replay(sb, jsb->seq, start);
+        j->head = j->tail = JOURNAL_LOG_START;
+        jset_init(&j->running);
+        jset_init(&j->group);
+        jset_init(&j->logging);
+        jset_init(&j->committed);
+        jset_init(&j->checkpointing);
+        j->commit_interval = JOURNAL_COMMIT_INTERVAL;
+        pthread_mutex_init(&j->lock, NULL);
+        pthread_cond_init(&j->cond, NULL);
+        /* everything replayed is in place now */
+        if (j->seq != jsb->seq || start != JOURNAL_LOG_START)
+                testfs_journal_write_super(sb, j->seq, JOURNAL_LOG_START);
+        sb->journal = j;
+        if ((ret = pthread_create(&j->commit_thread, NULL,
+                                  testfs_journal_commit_thread, sb)) != 0)
+                goto fail;
+        if ((ret = pthread_create(&j->checkpoint_thread, NULL,
+                                  testfs_journal_checkpoint_thread, sb)) != 0) {
+                testfs_journal_stop(j);
+                pthread_join(j->commit_thread, NULL);
+                goto fail;
+        }
+        return 0;
+fail:
+        sb->journal = NULL;
+        pthread_mutex_destroy(&j->lock);
+        pthread_cond_destroy(&j->cond);
+        bitmap_destroy(j->discard);
+        free(j->alloc_tx);
+        free(j->free_tx);
+        free(j);
+        return -ret;
+}
+
+/* stops the journal threads, logs the last group, and checkpoints the
+ * log */
+void
+testfs_journal_destroy(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+
+        assert(j->running.nr == 0);
+        testfs_journal_stop(j);
+        pthread_join(j->commit_thread, NULL);
+        pthread_join(j->checkpoint_thread, NULL);
+        testfs_journal_sync(sb);
+        testfs_journal_checkpoint(sb);
+        pthread_mutex_destroy(&j->lock);
+        pthread_cond_destroy(&j->cond);
+        assert(j->nr_discard == 0);
+        bitmap_destroy(j->discard);
+        free(j->alloc_tx);
+        free(j->free_tx);
+        free(j);
+        sb->journal = NULL;
+}
+
+/* sets how long, in ms, a committed transaction may wait to be logged with
+ * the transactions that follow it. 0 logs each transaction at commit. */
+void
+testfs_journal_set_commit_interval(struct super_block *sb, int ms)
+{
+        struct journal *j = sb->journal;
+
+        assert(ms >= 0);
+        pthread_mutex_lock(&j->lock);
+        j->commit_interval = ms;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* sets whether file data is journaled, or written in place before the
+ * metadata that points to it is committed */
+void
+testfs_journal_set_mode(struct super_block *sb, int mode)
+{
+        assert(mode == JOURNAL_MODE_ORDERED || mode == JOURNAL_MODE_DATA);
+        assert(testfs_tx_in_progress(sb) == TX_NONE);
+        pthread_mutex_lock(&sb->journal->lock);
+        sb->journal->mode = mode;
+        pthread_mutex_unlock(&sb->journal->lock);
+}
+
+/* logs the committed transactions now, making them durable */
+void
+testfs_journal_sync(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+
+        pthread_mutex_lock(&j->lock);
+        testfs_journal_flush(sb);
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* writes the committed blocks in place and empties the log */
+void
+testfs_journal_checkpoint(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+
+        pthread_mutex_lock(&j->lock);
+        testfs_journal_checkpoint_locked(sb);
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* returns the newest version of block nr that the journal has not written
+ * in place, called with j->lock held */
+static struct jblock *
+testfs_journal_find(struct journal *j, int nr)
+{
+        struct jblock *jb;
+
+        if ((jb = jset_find(&j->group, nr)) == NULL &&
+            (jb = jset_find(&j->logging, nr)) == NULL &&
+            (jb = jset_find(&j->committed, nr)) == NULL) {
+                jb = jset_find(&j->checkpointing, nr);
+        }
+        return jb;
+}
+
+/* adds a block to the running transaction, called with j->lock held */
+static void
+testfs_journal_add(struct journal *j, const char *block, int nr)
+{
+        struct jblock *jb = jset_find(&j->running, nr);
+
+        if (!jb) {
+                if ((jb = malloc(sizeof(struct jblock))) == NULL) {
+                        EXIT("malloc");
+                }
+                jb->nr = nr;
+                jset_add(&j->running, jb);
+        }
+        memcpy(jb->data, block, BLOCK_SIZE);
+}
+
+/* logs blocks while a transaction is running.
+ * returns 0 if the blocks should be written in place instead. */
+int
+testfs_journal_write(struct super_block *sb, const char *blocks, int start,
+                     int nr)
+{
+        struct journal *j = sb->journal;
+        int i;
+
+        if (testfs_tx_in_progress(sb) == TX_NONE) {
+                /* a later checkpoint or replay would overwrite the blocks */
+                pthread_mutex_lock(&j->lock);
+                for (i = 0; i < nr; i++) {
+                        if (testfs_journal_find(j, start + i)) {
+                                testfs_journal_flush(sb);
+                                testfs_journal_checkpoint_locked(sb);
+                                break;
+                        }
+                }
+                pthread_mutex_unlock(&j->lock);
+                return 0;
+        }
+        pthread_mutex_lock(&j->lock);
+        for (i = 0; i < nr; i++) {
+                testfs_journal_add(j, blocks + i * BLOCK_SIZE, start + i);
+        }
+        pthread_mutex_unlock(&j->lock);
+        return 1;
+}
+
+/* returns whether data block nr can be written in place in ordered
+ * mode, called with j->lock held */
+static int
+testfs_journal_data_in_place(struct super_block *sb, int nr)
+{
+        struct journal *j = sb->journal;
+        int i = nr - sb->sb.data_blocks_start;
+
+        assert(i >= 0 && i < JOURNAL_NR_DATA_BLOCKS);
+        return j->alloc_tx[i] == j->tx && !jset_find(&j->running, nr) &&
+                j->free_tx[i] <= j->logged_tx && !testfs_journal_find(j, nr);
+}
+
+/* writes blocks of file data. in data mode, or outside a transaction, they
+ * are written as other blocks. in ordered mode, the blocks that can be
+ * are written in place, in runs, and the others are logged. */
+void
+testfs_journal_write_data(struct super_block *sb, const char *blocks,
+                          int start, int nr)
+{
+        struct journal *j = sb->journal;
+        int i, run, mode;
+
+        pthread_mutex_lock(&j->lock);
+        mode = j->mode;
+        pthread_mutex_unlock(&j->lock);
+        if (mode == JOURNAL_MODE_DATA || 
+            testfs_tx_in_progress(sb) == TX_NONE) {
+                if (!testfs_journal_write(sb, blocks, start, nr))
+                        dev_write_blocks(sb, (char *)blocks, start, nr);
+                return;
+        }
+        /* the blocks belong to an inode locked by the caller, so no other
+         * thread journals them between the checks and the writes */
+        for (i = 0; i < nr; i += run) {
+                pthread_mutex_lock(&j->lock);
+                if (!testfs_journal_data_in_place(sb, start + i)) {
+                        testfs_journal_add(j, blocks + i * BLOCK_SIZE,
+                                           start + i);
+                        pthread_mutex_unlock(&j->lock);
+                        run = 1;
+                        continue;
+                }
+                for (run = 1; i + run < nr &&
+                     testfs_journal_data_in_place(sb, start + i + run); run++)
+                        ;
+                pthread_mutex_unlock(&j->lock);
+                dev_write_blocks(sb, (char *)blocks + i * BLOCK_SIZE,
+                                 start + i, run);
+        }
+}
+
+/* records that the running transaction allocated data block nr */
+void
+testfs_journal_alloc_block(struct super_block *sb, int nr)
+{
+        struct journal *j = sb->journal;
+
+        nr -= sb->sb.data_blocks_start;
+        assert(nr >= 0 && nr < JOURNAL_NR_DATA_BLOCKS);
+        pthread_mutex_lock(&j->lock);
+        j->alloc_tx[nr] = j->tx;
+        if (bitmap_isset(j->discard, nr)) {
+                bitmap_unmark(j->discard, nr);
+                j->nr_discard--;
+        }
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* records that the running transaction freed data block nr. with
+ * discard, the block is discarded once the transaction is logged. */
+void
+testfs_journal_free_block(struct super_block *sb, int nr)
+{
+        struct journal *j = sb->journal;
+
+        nr -= sb->sb.data_blocks_start;
+        assert(nr >= 0 && nr < JOURNAL_NR_DATA_BLOCKS);
+        pthread_mutex_lock(&j->lock);
+        j->free_tx[nr] = j->tx;
+        if (sb->discard) {
+                bitmap_mark(j->discard, nr);
+                j->nr_discard++;
+        }
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* returns the number of checkpoints that completed so far, to be passed
+ * to testfs_journal_read after the blocks are read in place */
+int
+testfs_journal_read_begin(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+        int gen;
+
+        pthread_mutex_lock(&j->lock);
+        gen = j->cp_gen;
+        pthread_mutex_unlock(&j->lock);
+        return gen;
+}
+
+/* replaces the blocks read from their home location with the versions
+ * that have not been written in place yet.
+ * returns 0 if a checkpoint completed since gen, in which case the blocks
+ * may have been read before it wrote them, and must be read again. */
+int
+testfs_journal_read(struct super_block *sb, char *blocks, int start, int nr,
+                    int gen)
+{
+        struct journal *j = sb->journal;
+        int i;
+
+        pthread_mutex_lock(&j->lock);
+        if (j->cp_gen != gen) {
+                pthread_mutex_unlock(&j->lock);
+                return 0;
+        }
+        for (i = 0; i < nr; i++) {
+                struct jblock *jb = jset_find(&j->running, start + i);
+
+                if (!jb)
+                        jb = testfs_journal_find(j, start + i);
+                if (jb)
+                        memcpy(blocks + i * BLOCK_SIZE, jb->data, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&j->lock);
+        return 1;
+}
+
+/* joins the running transaction, waiting until it can be joined */
+void
+testfs_journal_start(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+
+        pthread_mutex_lock(&j->lock);
+        while (j->closing)
+                pthread_cond_wait(&j->cond, &j->lock);
+        j->nr_handles++;
+        pthread_mutex_unlock(&j->lock);
+}
+
+/* leaves the running transaction. the last one to leave adds it to the
+ * group. the group is logged by the commit thread when its interval has
+ * passed, or now if it is large. */
+void
+testfs_journal_commit(struct super_block *sb)
+{
+        struct journal *j = sb->journal;
+
+        pthread_mutex_lock(&j->lock);
+        assert(j->nr_handles > 0);
+        if (--j->nr_handles > 0) {
+                if (j->running.nr >= JOURNAL_GROUP_BLOCKS)
+                        j->closing = 1;
+                pthread_mutex_unlock(&j->lock);
+                return;
+        }
+        if (j->closing) {
+                j->closing = 0;
+                pthread_cond_broadcast(&j->cond);
+        }
+        /* the blocks allocated or freed by the tx are no longer its own */
+        j->tx++;
+        if (j->running.nr == 0) {
+                pthread_mutex_unlock(&j->lock);
+                return;
+        }
+        j->group_tx = j->tx - 1;
+        if (j->group.nr == 0) {
+                clock_gettime(CLOCK_REALTIME, &j->deadline);
+                j->deadline.tv_sec += j->commit_interval / 1000;
+                j->deadline.tv_nsec += (j->commit_interval % 1000) * 1000000;
+                if (j->deadline.tv_nsec >= 1000000000) {
+                        j->deadline.tv_sec++;
+                        j->deadline.tv_nsec -= 1000000000;
+                }
+        }
+        jset_move(&j->group, &j->running);
+        if (j->commit_interval == 0 || j->group.nr >= JOURNAL_GROUP_BLOCKS)
+                testfs_journal_flush(sb);
+        else
+                pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+}
@@ -0,0 +1,64 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include "testfs.h"
+
+/* the journal region starts with a journal superblock. the log follows,
+ * as a sequence of transactions. a transaction is one or more descriptor
+ * blocks, each followed by the blocks it describes, and a commit block. */
+#define JOURNAL_MAGIC           0x6a736674
+#define JOURNAL_DESCRIPTOR      1
+#define JOURNAL_COMMIT          2
+
+struct djournal_super {
+        int magic;
+        int seq;                /* sequence number of first record */
+        int start;              /* log block of first record */
+};
+
+struct djournal_header {
+        int magic;
+        int type;
+        int seq;
+        int nr;                 /* blocks described, or in the transaction */
+};
+
+struct djournal_commit {
+        struct djournal_header h;
+        int csum;               /* of the blocks in the transaction */
+};
+
+/* home block numbers that follow the header of a descriptor block */
+#define JOURNAL_TAGS_PER_BLOCK \
+        ((BLOCK_SIZE - sizeof(struct djournal_header)) / sizeof(int))
+
+/* default ms a committed transaction waits to be logged with the ones
+ * that follow it */
+#define JOURNAL_COMMIT_INTERVAL 10
+
+/* how file data is written */
+#define JOURNAL_MODE_ORDERED    0       /* in place, before the metadata */
+#define JOURNAL_MODE_DATA       1       /* logged with the metadata */
+
+struct super_block;
+
+void testfs_make_journal(struct super_block *sb);
+int testfs_journal_init(struct super_block *sb, int clean);
+void testfs_journal_destroy(struct super_block *sb);
+int testfs_journal_write(struct super_block *sb, const char *blocks, int start,
+                         int nr);
+int testfs_journal_read_begin(struct super_block *sb);
+int testfs_journal_read(struct super_block *sb, char *blocks, int start, 
+                        int nr, int gen);
+void testfs_journal_start(struct super_block *sb);
+void testfs_journal_commit(struct super_block *sb);
+void testfs_journal_checkpoint(struct super_block *sb);
+void testfs_journal_sync(struct super_block *sb);
+void testfs_journal_set_commit_interval(struct super_block *sb, int ms);
+void testfs_journal_set_mode(struct super_block *sb, int mode);
+void testfs_journal_write_data(struct super_block *sb, const char *blocks,
+                               int start, int nr);
+void testfs_journal_alloc_block(struct super_block *sb, int nr);
+void testfs_journal_free_block(struct super_block *sb, int nr);
+
+#endif /* _JOURNAL_H */
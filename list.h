@@ -345,4 +345,17 @@ unsigned int hash_int(unsigned int val, unsigned int bits)
 	return hash >> (32 - bits);
 }
 
+static inline
+unsigned int hash_str(const char *str, unsigned int bits)
+{
+	/* FNV-1a, folded down to bits with hash_int */
+	unsigned int hash = 2166136261U;
+
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619U;
+	}
+	return hash_int(hash, bits);
+}
+
 #endif /* _LIST_H_ */
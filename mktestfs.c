@@ -2,6 +2,7 @@
 #include "super.h"
 #include "inode.h"
 #include "dir.h"
+#include "journal.h"
 #include "common.h"
 
 static void
@@ -26,6 +27,7 @@ main(int argc, char *argv[])
         testfs_make_block_freemap(sb);
         testfs_make_csum_table(sb);
         testfs_make_inode_blocks(sb);
+        testfs_make_journal(sb);
         testfs_close_super_block(sb);
 
         ret = testfs_init_super_block(argv[1], 0, &sb);
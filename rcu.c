@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include "testfs.h"
+#include "rcu.h"
+
+/* each reader thread has its own counter, in its own cache line, so that
+ * readers only write lines that no other thread reads often. a reader
+ * copies rcu_gp into its counter when it starts reading, and zeroes it
+ * when it is done. rcu_synchronize advances rcu_gp, and waits for the
+ * readers that started before, whose counter is neither zero nor the new
+ * rcu_gp.
+ *
+ * freed entries are queued, and once RCU_BATCH of them are queued, the
+ * next rcu_reclaim frees them after one rcu_synchronize. rcu_free never
+ * waits, since its callers hold cache locks that lookups need. */
+#define RCU_BATCH 64
+#define CACHE_LINE 64
+
+struct rcu_reader {
+        unsigned long ctr;              /* rcu_gp when it started, or 0 */
+        int depth;                      /* of nested read sections */
+        struct rcu_reader *next;
+} __attribute__((aligned(CACHE_LINE)));
+
+static unsigned long rcu_gp = 1;
+static struct rcu_reader *rcu_readers;
+static pthread_mutex_t rcu_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct rcu_head *rcu_pending;
+static int rcu_nr_pending;
+static pthread_mutex_t rcu_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct rcu_reader *rcu_self;
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+
+/* forget the reader of an exiting thread */
+static void
+rcu_unregister(void *arg)
+{
+        struct rcu_reader *r = arg, **rp;
+
+        assert(r->depth == 0);
+        pthread_mutex_lock(&rcu_readers_lock);
+        for (rp = &rcu_readers; *rp != r; rp = &(*rp)->next)
+                ;
+        *rp = r->next;
+        pthread_mutex_unlock(&rcu_readers_lock);
+        free(r);
+}
+
+static void
+rcu_key_init(void)
+{
+        if (pthread_key_create(&rcu_key, rcu_unregister) != 0) {
+                EXIT("pthread_key_create");
+        }
+}
+
+static struct rcu_reader *
+rcu_reader(void)
+{
+        struct rcu_reader *r = rcu_self;
+
+        if (r)
+                return r;
+        pthread_once(&rcu_key_once, rcu_key_init);
+        if (posix_memalign((void **)&r, CACHE_LINE,
+                           sizeof(struct rcu_reader)) != 0) {
+                EXIT("posix_memalign");
+        }
+        r->ctr = 0;
+        r->depth = 0;
+        pthread_mutex_lock(&rcu_readers_lock);
+        r->next = rcu_readers;
+        rcu_readers = r;
+        pthread_mutex_unlock(&rcu_readers_lock);
+        pthread_setspecific(rcu_key, r);
+        rcu_self = r;
+        return r;
+}
+
+void
+rcu_read_lock(void)
+{
+        struct rcu_reader *r = rcu_reader();
+
+        if (r->depth++ > 0)
+                return;
+        __atomic_store_n(&r->ctr, __atomic_load_n(&rcu_gp, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        /* the counter is set before any shared entry is read */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+rcu_read_unlock(void)
+{
+        struct rcu_reader *r = rcu_self;
+
+        assert(r && r->depth > 0);
+        if (--r->depth > 0)
+                return;
+        __atomic_store_n(&r->ctr, 0, __ATOMIC_RELEASE);
+}
+
+/* waits until the readers that may see entries unlinked before the call
+ * are done. must not be called by a reader. */
+void
+rcu_synchronize(void)
+{
+        struct rcu_reader *r;
+        unsigned long gp, ctr;
+
+        assert(!rcu_self || rcu_self->depth == 0);
+        pthread_mutex_lock(&rcu_readers_lock);
+        /* the entries are unlinked before rcu_gp advances */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+        for (r = rcu_readers; r; r = r->next) {
+                while ((ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE)) &&
+                       ctr != gp)
+                        sched_yield();
+        }
+        pthread_mutex_unlock(&rcu_readers_lock);
+}
+
+static void
+rcu_free_list(struct rcu_head *head)
+{
+        struct rcu_head *next;
+
+        rcu_synchronize();
+        for (; head; head = next) {
+                next = head->next;
+                free(head->ptr);
+        }
+}
+
+/* queues ptr, which contains head and has been unlinked, to be freed
+ * once no reader can see it. it is freed by rcu_reclaim or rcu_barrier. */
+void
+rcu_free(struct rcu_head *head, void *ptr)
+{
+        head->ptr = ptr;
+        pthread_mutex_lock(&rcu_pending_lock);
+        head->next = rcu_pending;
+        rcu_pending = head;
+        __atomic_add_fetch(&rcu_nr_pending, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&rcu_pending_lock);
+}
+
+/* frees the queued entries if there is a batch of them. it waits for
+ * readers, so the caller must not hold a cache lock, and must not be a
+ * reader. */
+void
+rcu_reclaim(void)
+{
+        struct rcu_head *batch = NULL;
+
+        if (__atomic_load_n(&rcu_nr_pending, __ATOMIC_RELAXED) < RCU_BATCH)
+                return;
+        pthread_mutex_lock(&rcu_pending_lock);
+        if (rcu_nr_pending >= RCU_BATCH) {
+                batch = rcu_pending;
+                rcu_pending = NULL;
+                __atomic_store_n(&rcu_nr_pending, 0, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&rcu_pending_lock);
+        if (batch)
+                rcu_free_list(batch);
+}
+
+/* frees all queued entries */
+void
+rcu_barrier(void)
+{
+        struct rcu_head *batch;
+
+        pthread_mutex_lock(&rcu_pending_lock);
+        batch = rcu_pending;
+        rcu_pending = NULL;
+        __atomic_store_n(&rcu_nr_pending, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&rcu_pending_lock);
+        rcu_free_list(batch);
+}
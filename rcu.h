@@ -0,0 +1,59 @@
+#ifndef _RCU_H
+#define _RCU_H
+
+#include "list.h"
+
+/* read-copy-update. readers look up shared structures without locks,
+ * between rcu_read_lock and rcu_read_unlock, and never block in between.
+ * writers still serialize with their own locks, publish new entries with
+ * rcu_assign_pointer, and queue unlinked entries with rcu_free. queued
+ * entries are freed by rcu_reclaim, which waits until no reader can still
+ * see them, and which writers call after they drop their locks. */
+
+struct rcu_head {
+        struct rcu_head *next;
+        void *ptr;
+};
+
+#define rcu_dereference(p)      __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_synchronize(void);
+void rcu_free(struct rcu_head *head, void *ptr);
+void rcu_reclaim(void);
+void rcu_barrier(void);
+
+/* hash lists that readers walk while writers change them */
+static inline void hlist_add_head_rcu(struct hlist_node *n,
+                                      struct hlist_head *h)
+{
+        struct hlist_node *first = h->first;
+
+        n->next = first;
+        n->pprev = &h->first;
+        rcu_assign_pointer(h->first, n);
+        if (first)
+                first->pprev = &n->next;
+}
+
+/* n->next is kept, since readers may be on n */
+static inline void hlist_del_rcu(struct hlist_node *n)
+{
+        struct hlist_node *next = n->next;
+        struct hlist_node **pprev = n->pprev;
+
+        rcu_assign_pointer(*pprev, next);
+        if (next)
+                next->pprev = pprev;
+        n->pprev = NULL;
+}
+
+#define hlist_for_each_entry_rcu(tpos, pos, head, member)               \
+        for (pos = rcu_dereference((head)->first);                      \
+             pos &&                                                     \
+                ({ tpos = hlist_entry(pos, typeof(*tpos), member); 1;}); \
+             pos = rcu_dereference(pos->next))
+
+#endif /* _RCU_H */
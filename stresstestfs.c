@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
+#include "dir.h"
+#include "tx.h"
+#include "journal.h"
+
+/* runs random commands on one image from several threads at once, and
+ * then checks the file system. each thread works mostly in its own
+ * directory, and sometimes in /shared, so that threads both contend on
+ * the same directory and run side by side on different ones. the output
+ * of the commands is thrown away.
+ *
+ * with -r, the threads instead look up a tree that is made up front,
+ * mostly with stat and cat, so that most lookups are served from the
+ * inode and dentry caches without locks. some lookups miss, and some
+ * files are created and removed, so that cached entries are replaced and
+ * freed while other threads read them. */
+
+#define MAX_THREADS 64
+#define NR_NAMES 8
+#define MAX_WRITE 250
+#define NR_READ_DIRS 8
+#define NR_READ_FILES 16
+#define NR_MISSES 2048          /* more than fit in the dentry cache */
+
+static struct super_block *sb;
+static int nr_iter = 300;
+static int nr_failed;
+static int read_mostly;
+
+static void
+usage(const char *progname)
+{
+        fprintf(stderr, "Usage: %s [-dr][-j ordered|data][-t threads]"
+                "[-n iterations] rawfile\n", progname);
+        exit(1);
+}
+
+/* these errors are expected when threads race on the same names */
+static int
+expected_error(int ret)
+{
+        return ret == -ENOENT || ret == -EEXIST || ret == -ENOTEMPTY ||
+                ret == -ENOSPC;
+}
+
+/* runs the command in fmt, like a line typed at the testfs prompt */
+static int
+run_command(struct context *c, int (*func)(struct super_block *,
+                                           struct context *),
+            const char *fmt, ...)
+{
+        char line[MAX_WRITE + 64];
+        char *token, *save;
+        va_list ap;
+        int ret;
+
+        va_start(ap, fmt);
+        vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+        c->nargs = 0;
+        for (token = strtok_r(line, " ", &save); token && c->nargs < MAX_ARGS;
+             token = strtok_r(NULL, " ", &save)) {
+                c->cmd[c->nargs++] = token;
+        }
+        memset(c->cmd + c->nargs, 0,
+               (MAX_ARGS + 1 - c->nargs) * sizeof(char *));
+        ret = func(sb, c);
+        if (ret < 0 && !expected_error(ret)) {
+                errno = -ret;
+                WARN(c->cmd[0]);
+                __atomic_add_fetch(&nr_failed, 1, __ATOMIC_RELAXED);
+        }
+        return ret;
+}
+
+static void *
+worker(void *arg)
+{
+        long t = (long)arg;
+        unsigned int seed = t + 1;
+        struct context c;
+        char dir[32], file[64], data[MAX_WRITE + 1];
+        int i, k, len;
+
+        c.cur_dir = testfs_get_inode(sb, 0); /* root dir */
+        snprintf(dir, sizeof(dir), "/d%ld", t);
+        run_command(&c, cmd_mkdir, "mkdir %s", dir);
+        for (i = 0; i < nr_iter; i++) {
+                k = rand_r(&seed) % NR_NAMES;
+                snprintf(file, sizeof(file), "%s/f%d",
+                         (rand_r(&seed) % 4) ? dir : "/shared", k);
+                switch (rand_r(&seed) % 8) {
+                case 0:
+                        run_command(&c, cmd_create, "touch %s", file);
+                        break;
+                case 1:
+                case 2:
+                        len = 1 + rand_r(&seed) % MAX_WRITE;
+                        memset(data, 'a' + t % 26, len);
+                        data[len] = 0;
+                        run_command(&c, cmd_write, "write %s %s", file, data);
+                        break;
+                case 3:
+                        run_command(&c, cmd_cat, "cat %s", file);
+                        break;
+                case 4:
+                        run_command(&c, cmd_rm, "rm %s", file);
+                        break;
+                case 5:
+                        run_command(&c, cmd_stat, "stat %s", file);
+                        break;
+                case 6:
+                        if (rand_r(&seed) % 2)
+                                run_command(&c, cmd_mkdir, "mkdir /shared/s%d",
+                                            k);
+                        else
+                                run_command(&c, cmd_rm, "rm /shared/s%d", k);
+                        break;
+                case 7:
+                        run_command(&c, cmd_ls, "ls %s", dir);
+                        break;
+                }
+        }
+        testfs_put_inode(c.cur_dir);
+        return NULL;
+}
+
+/* makes the tree that read_worker looks up */
+static void
+make_read_tree(struct context *c)
+{
+        int i, j;
+
+        run_command(c, cmd_mkdir, "mkdir /r");
+        for (i = 0; i < NR_READ_DIRS; i++) {
+                run_command(c, cmd_mkdir, "mkdir /r/d%d", i);
+                for (j = 0; j < NR_READ_FILES; j++) {
+                        run_command(c, cmd_create, "touch /r/d%d/f%d", i, j);
+                        run_command(c, cmd_write, "write /r/d%d/f%d %d.%d",
+                                    i, j, i, j);
+                }
+        }
+}
+
+static void *
+read_worker(void *arg)
+{
+        long t = (long)arg;
+        unsigned int seed = t + 1;
+        struct context c;
+        int i, d, k;
+
+        c.cur_dir = testfs_get_inode(sb, 0); /* root dir */
+        for (i = 0; i < nr_iter; i++) {
+                d = rand_r(&seed) % NR_READ_DIRS;
+                k = rand_r(&seed) % NR_READ_FILES;
+                switch (rand_r(&seed) % 16) {
+                case 0:
+                        run_command(&c, cmd_stat, "stat /r/d%d/n%d", d,
+                                    rand_r(&seed) % NR_MISSES);
+                        break;
+                case 1:
+                        run_command(&c, cmd_create, "touch /r/d%d/t%d", d, k);
+                        break;
+                case 2:
+                        run_command(&c, cmd_rm, "rm /r/d%d/t%d", d, k);
+                        break;
+                case 3:
+                        run_command(&c, cmd_ls, "ls /r/d%d", d);
+                        break;
+                case 4:
+                case 5:
+                case 6:
+                        run_command(&c, cmd_cat, "cat /r/d%d/f%d", d, k);
+                        break;
+                default:
+                        run_command(&c, cmd_stat, "stat /r/d%d/f%d /r/d%d",
+                                    d, k, d);
+                        break;
+                }
+        }
+        testfs_put_inode(c.cur_dir);
+        return NULL;
+}
+
+int
+main(int argc, char * const argv[])
+{
+        pthread_t threads[MAX_THREADS];
+        struct context c;
+        int nr_threads = 8, delalloc = 0, journal_mode = -1;
+        int opt, out, null, ret;
+        long i;
+
+        while ((opt = getopt(argc, argv, "drj:t:n:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        delalloc = 1;
+                        break;
+                case 'r':
+                        read_mostly = 1;
+                        break;
+                case 'j':
+                        if (strcmp(optarg, "ordered") == 0)
+                                journal_mode = JOURNAL_MODE_ORDERED;
+                        else if (strcmp(optarg, "data") == 0)
+                                journal_mode = JOURNAL_MODE_DATA;
+                        else
+                                usage(argv[0]);
+                        break;
+                case 't':
+                        nr_threads = atoi(optarg);
+                        if (nr_threads < 1 || nr_threads > MAX_THREADS)
+                                usage(argv[0]);
+                        break;
+                case 'n':
+                        nr_iter = atoi(optarg);
+                        if (nr_iter < 0)
+                                usage(argv[0]);
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (argc - optind != 1)
+                usage(argv[0]);
+
+        ret = testfs_init_super_block(argv[optind], 0, &sb);
+        if (ret) {
+                errno = -ret;
+                EXIT(argv[optind]);
+        }
+        sb->delalloc = delalloc;
+        if (sb->journal && journal_mode >= 0)
+                testfs_journal_set_mode(sb, journal_mode);
+        c.cur_dir = testfs_get_inode(sb, 0); /* root dir */
+        if (read_mostly)
+                make_read_tree(&c);
+        else
+                run_command(&c, cmd_mkdir, "mkdir /shared");
+
+        fflush(stdout);
+        if ((out = dup(STDOUT_FILENO)) < 0 ||
+            (null = open("/dev/null", O_WRONLY)) < 0 ||
+            dup2(null, STDOUT_FILENO) < 0) {
+                EXIT("dup");
+        }
+        close(null);
+        for (i = 0; i < nr_threads; i++) {
+                if (pthread_create(&threads[i], NULL,
+                                   read_mostly ? read_worker : worker,
+                                   (void *)i) != 0) {
+                        EXIT("pthread_create");
+                }
+        }
+        for (i = 0; i < nr_threads; i++) {
+                pthread_join(threads[i], NULL);
+        }
+        fflush(stdout);
+        if (dup2(out, STDOUT_FILENO) < 0) {
+                EXIT("dup2");
+        }
+        close(out);
+
+        run_command(&c, cmd_checkfs, "checkfs");
+        testfs_put_inode(c.cur_dir);
+        testfs_close_super_block(sb);
+        if (nr_failed) {
+                fprintf(stderr, "%d commands failed\n", nr_failed);
+                return 1;
+        }
+        return 0;
+}
@@ -5,10 +5,95 @@
 #include "block.h"
 #include "bitmap.h"
 #include "csum.h"
+#include "discard.h"
+#include "walk.h"
+#include "journal.h"
+#include "rcu.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+static void
+testfs_init_locks(struct super_block *sb)
+{
+        int i;
+
+        pthread_mutex_init(&sb->inode_lock, NULL);
+        pthread_mutex_init(&sb->dcache_lock, NULL);
+        for (i = 0; i < NR_GROUPS; i++) {
+                pthread_mutex_init(&sb->groups[i].lock, NULL);
+        }
+        pthread_mutex_init(&sb->freemap_lock, NULL);
+        pthread_mutex_init(&sb->alloc_lock, NULL);
+        pthread_mutex_init(&sb->csum_lock, NULL);
+}
+
+static void
+testfs_destroy_locks(struct super_block *sb)
+{
+        int i;
+
+        pthread_mutex_destroy(&sb->inode_lock);
+        pthread_mutex_destroy(&sb->dcache_lock);
+        for (i = 0; i < NR_GROUPS; i++) {
+                pthread_mutex_destroy(&sb->groups[i].lock);
+        }
+        pthread_mutex_destroy(&sb->freemap_lock);
+        pthread_mutex_destroy(&sb->alloc_lock);
+        pthread_mutex_destroy(&sb->csum_lock);
+}
+
+/* counts the free inodes and blocks of each group in the freemaps */
+static void
+testfs_count_groups(struct super_block *sb)
+{
+        struct group *g;
+        int i;
+
+        sb->nr_free_blocks = 0;
+        for (i = 0; i < NR_GROUPS; i++) {
+                g = &sb->groups[i];
+                g->nr_free_inodes = INODES_PER_GROUP - 
+                        bitmap_nr_allocated_range(sb->inode_freemap, 
+                                i * INODES_PER_GROUP, INODES_PER_GROUP);
+                g->nr_free_blocks = BLOCKS_PER_GROUP - 
+                        bitmap_nr_allocated_range(sb->block_freemap, 
+                                i * BLOCKS_PER_GROUP, BLOCKS_PER_GROUP);
+                sb->nr_free_blocks += g->nr_free_blocks;
+        }
+}
+
+/* sums the free counters of the groups */
+static void
+testfs_sum_groups(struct super_block *sb, int *nr_free_blocks, 
+                  int *nr_free_inodes)
+{
+        int i;
+
+        *nr_free_blocks = *nr_free_inodes = 0;
+        for (i = 0; i < NR_GROUPS; i++) {
+                pthread_mutex_lock(&sb->groups[i].lock);
+                *nr_free_blocks += sb->groups[i].nr_free_blocks;
+                *nr_free_inodes += sb->groups[i].nr_free_inodes;
+                pthread_mutex_unlock(&sb->groups[i].lock);
+        }
+}
+
+/* compares the free totals stored at a clean unmount with the groups
+ * counted from the freemaps. the freemaps are used if they differ. */
+static void
+testfs_check_free_counts(struct super_block *sb, const char *file)
+{
+        int nr_free_blocks, nr_free_inodes;
+
+        testfs_sum_groups(sb, &nr_free_blocks, &nr_free_inodes);
+        if (nr_free_blocks != sb->sb.nr_free_blocks ||
+            nr_free_inodes != sb->sb.nr_free_inodes) {
+                fprintf(stderr, "%s: free counts of the super block do not "
+                        "match the freemaps\n", file);
+        }
+}
+
 struct super_block *
 testfs_make_super_block(char *file)
 {
@@ -17,6 +102,7 @@ testfs_make_super_block(char *file)
         if (!sb) {
                 EXIT("malloc");
         }
+        testfs_init_locks(sb);
         if ((sb->dev = fopen(file, "w")) == NULL) {
                 EXIT(file);
         }
@@ -27,23 +113,44 @@ testfs_make_super_block(char *file)
                 BLOCK_FREEMAP_SIZE;
         sb->sb.inode_blocks_start = sb->sb.csum_table_start + 
                 CSUM_TABLE_SIZE;
-        sb->sb.data_blocks_start = sb->sb.inode_blocks_start + NR_INODE_BLOCKS;
+        sb->sb.journal_start = sb->sb.inode_blocks_start + NR_INODE_BLOCKS;
+        sb->sb.data_blocks_start = sb->sb.journal_start + JOURNAL_SIZE;
         sb->sb.modification_time = 0;
+        sb->sb.version = TESTFS_VERSION;
+        INIT_LIST_HEAD(&sb->da_inodes);
         testfs_write_super_block(sb);
-        inode_hash_init();
+        inode_hash_init(sb);
+        dcache_init(sb);
         return sb;
 }
 
 void
 testfs_make_inode_freemap(struct super_block *sb)
 {
+        int i;
+
+        /* each inode has a bit, and the groups split the inodes evenly */
+        assert(NR_INODES <= NR_INODE_FREEMAP_BITS);
+        assert(NR_INODES % (NR_GROUPS * BITS_PER_WORD) == 0);
         zero_blocks(sb, sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
+        for (i = 0; i < NR_GROUPS; i++) {
+                sb->groups[i].nr_free_inodes = INODES_PER_GROUP;
+        }
 }
 
 void
 testfs_make_block_freemap(struct super_block *sb)
 {
+        int i;
+
+        /* each data block has a bit, and the groups split them evenly */
+        assert(NR_DATA_BLOCKS <= NR_BLOCK_FREEMAP_BITS);
+        assert(NR_DATA_BLOCKS % (NR_GROUPS * BITS_PER_WORD) == 0);
         zero_blocks(sb, sb->sb.block_freemap_start, BLOCK_FREEMAP_SIZE);
+        for (i = 0; i < NR_GROUPS; i++) {
+                sb->groups[i].nr_free_blocks = BLOCKS_PER_GROUP;
+        }
+        sb->nr_free_blocks = NR_DATA_BLOCKS;
 }
 
 void
@@ -59,16 +166,39 @@ testfs_make_inode_blocks(struct super_block *sb)
 {
         /* dinodes should not span blocks */
         assert((BLOCK_SIZE % sizeof(struct dinode)) == 0);
+        /* i_unwritten has one bit per block of a file */
+        assert(MAX_FILE_BLOCKS <= sizeof(int) * CHAR_BIT);
         zero_blocks(sb, sb->sb.inode_blocks_start, NR_INODE_BLOCKS);
 }
 
-/* returns negative value on error */
+/* returns whether the regions recorded in the super block are the ones
+ * of this layout, whose inode blocks hold 64 byte dinodes */
+static int
+testfs_layout_ok(struct super_block *sb)
+{
+        int inode_blocks_end = sb->sb.version >= TESTFS_VERSION_JOURNAL ?
+                sb->sb.journal_start : sb->sb.data_blocks_start;
+
+        return sb->sb.inode_freemap_start == SUPER_BLOCK_SIZE &&
+                sb->sb.block_freemap_start == 
+                sb->sb.inode_freemap_start + INODE_FREEMAP_SIZE &&
+                sb->sb.csum_table_start == 
+                sb->sb.block_freemap_start + BLOCK_FREEMAP_SIZE &&
+                sb->sb.inode_blocks_start == 
+                sb->sb.csum_table_start + CSUM_TABLE_SIZE &&
+                inode_blocks_end - sb->sb.inode_blocks_start == 
+                NR_INODE_BLOCKS;
+}
+
+/* opens the image in file. each image has its own super block, caches
+ * and threads, so several images can be open in one process.
+ * returns negative value on error. */
 int
 testfs_init_super_block(const char *file, int corrupt, struct super_block **sbp)
 {
-        struct super_block *sb = malloc(sizeof(struct super_block));
+        struct super_block *sb = calloc(1, sizeof(struct super_block));
         char block[BLOCK_SIZE];
-        int ret, sock;
+        int ret, sock, clean;
 
         if (!sb) {
                 return -ENOMEM;
@@ -79,38 +209,80 @@ testfs_init_super_block(const char *file, int corrupt, struct super_block **sbp)
            | O_SYNC
 #endif
            )) < 0 ) {
-            return errno;
+            ret = -errno;
+            free(sb);
+            return ret;
         }
         else if ((sb->dev = fdopen(sock, "r+")) == NULL) {
-            return errno;
+            ret = -errno;
+            close(sock);
+            free(sb);
+            return ret;
         }	
+        testfs_init_locks(sb);
 
         read_blocks(sb, block, 0, 1);
         memcpy(&sb->sb, block, sizeof(struct dsuper_block));
+        if (sb->sb.version > TESTFS_VERSION || !testfs_layout_ok(sb)) {
+                ret = -EINVAL;
+                goto fail;
+        }
+        /* after a clean unmount, the journal is empty */
+        clean = sb->sb.version >= TESTFS_VERSION_CLEAN && sb->sb.clean;
+        /* replays the journal, before any other metadata is read */
+        if ((ret = testfs_journal_init(sb, clean)) < 0)
+                goto fail;
 
-        ret = bitmap_create(BLOCK_SIZE * INODE_FREEMAP_SIZE * BITS_PER_WORD,
-                            &sb->inode_freemap);
+        ret = bitmap_create(NR_INODE_FREEMAP_BITS, &sb->inode_freemap);
         if (ret < 0)
-                return ret;
+                goto fail;
         read_blocks(sb, bitmap_getdata(sb->inode_freemap), 
                     sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
 
-        ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD,
-                            &sb->block_freemap);
+        ret = bitmap_create(NR_BLOCK_FREEMAP_BITS, &sb->block_freemap);
         if (ret < 0)
-                return ret;
+                goto fail;
         read_blocks(sb, bitmap_getdata(sb->block_freemap), 
                     sb->sb.block_freemap_start, BLOCK_FREEMAP_SIZE);
+        /* the groups are counted even after a clean unmount, since only
+         * the totals are stored. the totals check the count instead. */
+        testfs_count_groups(sb);
+        if (clean)
+                testfs_check_free_counts(sb, file);
+        sb->nr_reserved_blocks = 0;
+        sb->delalloc = 0;
+        INIT_LIST_HEAD(&sb->da_inodes);
+        sb->discard = NULL;
         sb->csum_table = malloc(CSUM_TABLE_SIZE * BLOCK_SIZE);
-        if ( !sb->csum_table )
-                return -ENOMEM;
+        if ( !sb->csum_table ) {
+                ret = -ENOMEM;
+                goto fail;
+        }
         read_blocks(sb, (char *)sb->csum_table, sb->sb.csum_table_start, 
                     CSUM_TABLE_SIZE);
-        sb->tx_in_progress = TX_NONE;
-        inode_hash_init();
+        inode_hash_init(sb);
+        dcache_init(sb);
+        /* the image is not clean until it is unmounted */
+        if (sb->sb.clean) {
+                sb->sb.clean = 0;
+                testfs_write_super_block(sb);
+        }
         *sbp = sb;
         
         return 0;
+fail:
+        /* nothing has been changed yet, other than by journal replay */
+        if (sb->journal)
+                testfs_journal_destroy(sb);
+        if (sb->inode_freemap)
+                bitmap_destroy(sb->inode_freemap);
+        if (sb->block_freemap)
+                bitmap_destroy(sb->block_freemap);
+        free(sb->csum_table);
+        fclose(sb->dev);
+        testfs_destroy_locks(sb);
+        free(sb);
+        return ret;
 }
 
 void
@@ -119,6 +291,7 @@ testfs_write_super_block(struct super_block *sb)
         char block[BLOCK_SIZE] = {0};
 
         assert(sizeof(struct dsuper_block) <= BLOCK_SIZE);
+        testfs_sum_groups(sb, &sb->sb.nr_free_blocks, &sb->sb.nr_free_inodes);
         memcpy(block, &sb->sb, sizeof(struct dsuper_block));
         write_blocks(sb, block, 0, 1);
 }
@@ -127,8 +300,12 @@ void
 testfs_close_super_block(struct super_block *sb)
 {
         testfs_tx_start(sb, TX_UMOUNT);
+        testfs_flush_inodes(sb);
         testfs_write_super_block(sb);
-        inode_hash_destroy();
+        dcache_destroy(sb);
+        inode_hash_destroy(sb);
+        /* no lookups are left, free the entries they could have seen */
+        rcu_barrier();
         if (sb->inode_freemap) {
                 write_blocks(sb, bitmap_getdata(sb->inode_freemap), 
                              sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
@@ -142,12 +319,27 @@ testfs_close_super_block(struct super_block *sb)
                 sb->block_freemap = NULL;
         }
         testfs_tx_commit(sb, TX_UMOUNT);
+        if (sb->journal) {
+                testfs_journal_destroy(sb);
+        }
+        if (sb->discard) {
+                testfs_discard_destroy(sb);
+        }
+        /* written last, once everything else is in place */
+        sb->sb.clean = 1;
+        testfs_write_super_block(sb);
         fflush(sb->dev);
         fclose(sb->dev);
         sb->dev = NULL;
+        free(sb->csum_table);
+        testfs_destroy_locks(sb);
         free(sb);
 }
 
+/* the freemap blocks are written in turn, so that the last write of a
+ * block shared by several groups has the changes of all of them. the
+ * bits are changed under freemap_lock too, so that a write does not copy
+ * a block while another group changes it. */
 static void
 testfs_write_inode_freemap(struct super_block *sb, int inode_nr)
 {
@@ -157,8 +349,10 @@ testfs_write_inode_freemap(struct super_block *sb, int inode_nr)
         assert(sb->inode_freemap);
         freemap = bitmap_getdata(sb->inode_freemap);
         nr = inode_nr / (BLOCK_SIZE * BITS_PER_WORD);
+        pthread_mutex_lock(&sb->freemap_lock);
         write_blocks(sb, freemap + (nr * BLOCK_SIZE), 
                      sb->sb.inode_freemap_start + nr, 1);
+        pthread_mutex_unlock(&sb->freemap_lock);
 }
 
 static void
@@ -170,22 +364,118 @@ testfs_write_block_freemap(struct super_block *sb, int block_nr)
         assert(sb->block_freemap);
         freemap = bitmap_getdata(sb->block_freemap);
         nr = block_nr / (BLOCK_SIZE * BITS_PER_WORD);
+        pthread_mutex_lock(&sb->freemap_lock);
         write_blocks(sb, freemap + (nr * BLOCK_SIZE), 
                      sb->sb.block_freemap_start + nr, 1);
+        pthread_mutex_unlock(&sb->freemap_lock);
 }
 
-/* return free block number or negative value */
+/* the group that the calling thread starts its searches at. threads are
+ * given groups in turn, so that they work in different groups. */
 static int
-testfs_get_block_freemap(struct super_block *sb)
+testfs_thread_group(struct super_block *sb)
+{
+        static __thread int group = -1;
+
+        if (group < 0) {
+                pthread_mutex_lock(&sb->alloc_lock);
+                group = sb->next_group++ % NR_GROUPS;
+                pthread_mutex_unlock(&sb->alloc_lock);
+        }
+        return group;
+}
+
+/* returns the group of a new directory. directories are spread over the
+ * groups that have more free inodes and blocks than the average, starting
+ * at the group of the calling thread. */
+int
+testfs_dir_group(struct super_block *sb)
 {
+        int free_inodes[NR_GROUPS], free_blocks[NR_GROUPS];
+        int total_inodes = 0, total_blocks = 0;
+        int start = testfs_thread_group(sb);
+        int i, group, best = start;
+
+        for (i = 0; i < NR_GROUPS; i++) {
+                pthread_mutex_lock(&sb->groups[i].lock);
+                free_inodes[i] = sb->groups[i].nr_free_inodes;
+                free_blocks[i] = sb->groups[i].nr_free_blocks;
+                pthread_mutex_unlock(&sb->groups[i].lock);
+                total_inodes += free_inodes[i];
+                total_blocks += free_blocks[i];
+        }
+        for (i = 0; i < NR_GROUPS; i++) {
+                group = (start + i) % NR_GROUPS;
+                if (free_inodes[group] == 0)
+                        continue;
+                /* compared with the exact averages */
+                if (free_inodes[group] * NR_GROUPS >= total_inodes &&
+                    free_blocks[group] * NR_GROUPS >= total_blocks)
+                        return group;
+                if (free_inodes[group] > free_inodes[best])
+                        best = group;
+        }
+        return best;
+}
+
+/* allocates a block in group, which is locked.
+ * returns its index in the block freemap or negative value. */
+static int
+testfs_get_block_freemap(struct super_block *sb, int group)
+{
+        struct group *g = &sb->groups[group];
         u_int32_t index;
         int ret;
 
         assert(sb->block_freemap);
-        ret = bitmap_alloc(sb->block_freemap, &index);
+        if (g->nr_free_blocks == 0)
+                return -ENOSPC;
+        pthread_mutex_lock(&sb->freemap_lock);
+        ret = bitmap_alloc(sb->block_freemap, group * BLOCKS_PER_GROUP, 
+                           BLOCKS_PER_GROUP, &index);
+        pthread_mutex_unlock(&sb->freemap_lock);
+        assert(ret == 0);
+        g->nr_free_blocks--;
+        testfs_write_block_freemap(sb, index);
+        if (sb->discard)
+                testfs_discard_cancel(sb, sb->sb.data_blocks_start + index);
+        if (sb->journal)
+                testfs_journal_alloc_block(sb, sb->sb.data_blocks_start + index);
+        return index;
+}
+
+/* allocates nr physically contiguous blocks in group, which is locked.
+ * returns the index of the first one in the block freemap or negative
+ * value. */
+static int
+testfs_get_block_freemap_range(struct super_block *sb, int group, int nr)
+{
+        struct group *g = &sb->groups[group];
+        u_int32_t index;
+        int i, ret;
+
+        assert(sb->block_freemap);
+        if (g->nr_free_blocks < nr)
+                return -ENOSPC;
+        pthread_mutex_lock(&sb->freemap_lock);
+        ret = bitmap_alloc_range(sb->block_freemap, group * BLOCKS_PER_GROUP,
+                                 BLOCKS_PER_GROUP, nr, &index);
+        pthread_mutex_unlock(&sb->freemap_lock);
         if (ret < 0)
                 return ret;
-        testfs_write_block_freemap(sb, index);
+        g->nr_free_blocks -= nr;
+        for (i = 0; i < nr; i++) {
+                if (sb->discard)
+                        testfs_discard_cancel(sb, 
+                                sb->sb.data_blocks_start + index + i);
+                if (sb->journal)
+                        testfs_journal_alloc_block(sb, 
+                                sb->sb.data_blocks_start + index + i);
+                /* write each freemap block that was modified once */
+                if (i > 0 && ((index + i) % (BLOCK_SIZE * BITS_PER_WORD)) != 0)
+                        continue;
+                testfs_write_block_freemap(sb, index + i);
+        }
         return index;
 }
 
@@ -193,89 +483,280 @@ testfs_get_block_freemap(struct super_block *sb)
 static void
 testfs_put_block_freemap(struct super_block *sb, int block_nr)
 {
+        struct group *g = &sb->groups[block_nr / BLOCKS_PER_GROUP];
+
         assert(sb->block_freemap);
+        pthread_mutex_lock(&g->lock);
+        pthread_mutex_lock(&sb->freemap_lock);
         bitmap_unmark(sb->block_freemap, block_nr);
+        pthread_mutex_unlock(&sb->freemap_lock);
+        g->nr_free_blocks++;
         testfs_write_block_freemap(sb, block_nr);
+        pthread_mutex_unlock(&g->lock);
 }
 
-/* return free inode number or negative value */
+/* return free inode number or negative value. the inode is allocated in
+ * group, or in the next group that has a free inode. */
 int
-testfs_get_inode_freemap(struct super_block *sb)
+testfs_get_inode_freemap(struct super_block *sb, int group)
 {
+        struct group *g;
         u_int32_t index;
-        int ret;
+        int i, ret = -ENOSPC;
 
         assert(sb->inode_freemap);
-        ret = bitmap_alloc(sb->inode_freemap, &index);
-        if (ret < 0)
-                return ret;
-        testfs_write_inode_freemap(sb, index);
-        return index;
+        for (i = 0; i < NR_GROUPS && ret < 0; i++) {
+                g = &sb->groups[group];
+                pthread_mutex_lock(&g->lock);
+                if (g->nr_free_inodes > 0) {
+                        pthread_mutex_lock(&sb->freemap_lock);
+                        ret = bitmap_alloc(sb->inode_freemap, 
+                                           group * INODES_PER_GROUP,
+                                           INODES_PER_GROUP, &index);
+                        pthread_mutex_unlock(&sb->freemap_lock);
+                        assert(ret == 0);
+                        g->nr_free_inodes--;
+                        testfs_write_inode_freemap(sb, index);
+                        ret = index;
+                }
+                pthread_mutex_unlock(&g->lock);
+                group = (group + 1) % NR_GROUPS;
+        }
+        return ret;
 }
 
 /* release allocated inode */
 void
 testfs_put_inode_freemap(struct super_block *sb, int inode_nr)
 {
+        struct group *g = &sb->groups[INODE_GROUP(inode_nr)];
+
         assert(sb->inode_freemap);
+        pthread_mutex_lock(&g->lock);
+        pthread_mutex_lock(&sb->freemap_lock);
         bitmap_unmark(sb->inode_freemap, inode_nr);
+        pthread_mutex_unlock(&sb->freemap_lock);
+        g->nr_free_inodes++;
         testfs_write_inode_freemap(sb, inode_nr);
+        pthread_mutex_unlock(&g->lock);
 }
 
-/* allocate a block and return its block number.
+/* takes nr blocks off the free blocks that are not reserved, before they
+ * are allocated in a group, or gives them back when nr is negative.
  * returns negative value on error. */
-int
-testfs_alloc_block(struct super_block *sb, char *block)
+static int
+testfs_claim_blocks(struct super_block *sb, int nr)
 {
-        int phy_block_nr;
+        int ret = 0;
+
+        pthread_mutex_lock(&sb->alloc_lock);
+        if (nr > 0 && sb->nr_free_blocks - sb->nr_reserved_blocks < nr)
+                ret = -ENOSPC;
+        else
+                sb->nr_free_blocks -= nr;
+        pthread_mutex_unlock(&sb->alloc_lock);
+        return ret;
+}
 
-        phy_block_nr = testfs_get_block_freemap(sb);
-        if (phy_block_nr < 0)
-                return phy_block_nr;
-        bzero(block, BLOCK_SIZE);
+/* allocate a block and return its block number. the block is allocated in
+ * group, or in the next group that has a free block.
+ * block, if not NULL, is zeroed for use as the new block's contents.
+ * returns negative value on error. */
+int
+testfs_alloc_block(struct super_block *sb, int group, char *block)
+{
+        struct group *g;
+        int i, phy_block_nr = -ENOSPC;
+
+        if ((i = testfs_claim_blocks(sb, 1)) < 0)
+                return i;
+        /* the claim leaves a free block in some group */
+        for (i = 0; i < NR_GROUPS && phy_block_nr < 0; i++) {
+                g = &sb->groups[group];
+                pthread_mutex_lock(&g->lock);
+                phy_block_nr = testfs_get_block_freemap(sb, group);
+                pthread_mutex_unlock(&g->lock);
+                group = (group + 1) % NR_GROUPS;
+        }
+        assert(phy_block_nr >= 0);
+        if (block)
+                bzero(block, BLOCK_SIZE);
         return sb->sb.data_blocks_start + phy_block_nr;
 }
 
-/* free a block.
+/* allocate nr physically contiguous blocks and return the block number of
+ * the first one. the blocks are allocated in group, or in the next group
+ * that has room for them.
  * returns negative value on error. */
 int
-testfs_free_block(struct super_block *sb, int block_nr)
+testfs_alloc_blocks(struct super_block *sb, int group, int nr)
 {
+        struct group *g;
+        int i, ret;
+
+        if ((ret = testfs_claim_blocks(sb, nr)) < 0)
+                return ret;
+        ret = -ENOSPC;
+        for (i = 0; i < NR_GROUPS && ret < 0; i++) {
+                g = &sb->groups[group];
+                pthread_mutex_lock(&g->lock);
+                ret = testfs_get_block_freemap_range(sb, group, nr);
+                pthread_mutex_unlock(&g->lock);
+                group = (group + 1) % NR_GROUPS;
+        }
+        if (ret < 0) { /* no contiguous range left */
+                testfs_claim_blocks(sb, -nr);
+                return ret;
+        }
+        return sb->sb.data_blocks_start + ret;
+}
 
-        zero_blocks(sb, block_nr, 1);
+/* reserve nr blocks for later allocation with testfs_alloc_blocks, or
+ * release -nr reserved blocks when nr is negative.
+ * returns negative value on error. */
+int
+testfs_reserve_blocks(struct super_block *sb, int nr)
+{
+        int ret = 0;
+
+        pthread_mutex_lock(&sb->alloc_lock);
+        if (nr > 0 && sb->nr_free_blocks - sb->nr_reserved_blocks < nr) {
+                ret = -ENOSPC;
+        } else {
+                __atomic_add_fetch(&sb->nr_reserved_blocks, nr, 
+                                   __ATOMIC_RELAXED);
+                assert(sb->nr_reserved_blocks >= 0);
+        }
+        pthread_mutex_unlock(&sb->alloc_lock);
+        return ret;
+}
+
+/* free a block. the block is not zeroed, since testfs_alloc_block zeroes
+ * it when it is allocated again. with discard, it is punched out of the
+ * image file in the background, once the journal has logged the free.
+ * returns negative value on error. */
+int
+testfs_free_block(struct super_block *sb, int block_nr)
+{
+        if (sb->journal)
+                testfs_journal_free_block(sb, block_nr);
+        else if (sb->discard)
+                testfs_discard_block(sb, block_nr);
         block_nr -= sb->sb.data_blocks_start;
         assert(block_nr >= 0);
         testfs_put_block_freemap(sb, block_nr);
+        /* counted once the block can be allocated again */
+        testfs_claim_blocks(sb, -1);
         return 0;
 }
 
-static int
-testfs_checkfs(struct super_block *sb, struct bitmap *i_freemap, 
-        struct bitmap *b_freemap, int inode_nr)
+struct checkfs {
+        struct super_block *sb;
+        /* each walk thread marks its own freemaps */
+        struct bitmap *i_freemap[WALK_MAX_THREADS];
+        struct bitmap *b_freemap[WALK_MAX_THREADS];
+};
+
+/* marks in and its blocks in the freemaps */
+static void
+testfs_checkfs_inode(struct super_block *sb, struct bitmap *i_freemap, 
+        struct bitmap *b_freemap, struct inode *in)
 {
-        struct inode *in = testfs_get_inode(sb, inode_nr);
         int size;
         int size_roundup = ROUNDUP(testfs_inode_get_size(in), BLOCK_SIZE);
 
         assert((testfs_inode_get_type(in) == I_FILE) || 
                (testfs_inode_get_type(in) == I_DIR));
         /* inode processing */
-        bitmap_mark(i_freemap, inode_nr);
-        if (testfs_inode_get_type(in) == I_DIR) {
-                int offset = 0;
-                struct dirent *d;
-                for (; (d = testfs_next_dirent(in, &offset)); free(d)) {
-                        if ((d->d_inode_nr < 0) || 
-                            (strcmp(D_NAME(d), ".") == 0) || 
-                            (strcmp(D_NAME(d), "..") == 0))
-                                continue;
-                        testfs_checkfs(sb, i_freemap, b_freemap, d->d_inode_nr);
-                }
-        }
+        bitmap_mark(i_freemap, testfs_inode_get_nr(in));
         /* block processing */
         size = testfs_check_inode(sb, b_freemap, in);
-        assert(size == size_roundup);
-        testfs_put_inode(in);
+        if (testfs_inode_is_inline(in))
+                assert(size == 0);
+        else    /* less when the file has holes */
+                assert(size <= size_roundup);
+}
+
+/* checks the directory of node and the files in it, and queues its
+ * subdirectories */
+static int
+testfs_checkfs_visit(struct walk *w, struct walk_node *node, int thread,
+        void *arg)
+{
+        struct checkfs *cf = arg;
+        struct super_block *sb = cf->sb;
+        struct inode *dir, *in;
+        struct dirent_iter it;
+        struct dirent *d;
+        struct {
+                int inode_nr;
+                inode_type type;        /* recorded in the dirent */
+        } *children;
+        int i, nr = 0;
+        int ret;
+
+        if (!cf->i_freemap[thread]) {
+                ret = bitmap_create(BLOCK_SIZE * INODE_FREEMAP_SIZE * 
+                                    BITS_PER_WORD, &cf->i_freemap[thread]);
+                if (ret < 0)
+                        return ret;
+                ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * 
+                                    BITS_PER_WORD, &cf->b_freemap[thread]);
+                if (ret < 0)
+                        return ret;
+        }
+        dir = testfs_get_inode(sb, walk_node_inode_nr(node));
+        testfs_inode_rdlock(dir);
+        assert(testfs_inode_get_type(dir) == I_DIR);
+        testfs_checkfs_inode(sb, cf->i_freemap[thread], cf->b_freemap[thread],
+                             dir);
+        /* collect the children first, so that their inodes are prefetched
+         * while the earlier ones are checked */
+        children = malloc(testfs_inode_get_size(dir) / 
+                          (sizeof(struct dirent) + 1) * sizeof(*children));
+        if (!children) {
+                testfs_inode_unlock(dir);
+                testfs_put_inode(dir);
+                return -ENOMEM;
+        }
+        testfs_dirent_iter_init(&it, dir);
+        while ((d = testfs_dirent_iter_next(&it))) {
+                if ((d->d_inode_nr < 0) || 
+                    (strcmp(D_NAME(d), ".") == 0) || 
+                    (strcmp(D_NAME(d), "..") == 0))
+                        continue;
+                children[nr].inode_nr = d->d_inode_nr;
+                children[nr].type = d->d_type;
+                testfs_prefetch_inode(sb, d->d_inode_nr);
+                nr++;
+        }
+        testfs_dirent_iter_destroy(&it);
+        testfs_inode_unlock(dir);
+        testfs_put_inode(dir);
+        if (it.error < 0) {
+                free(children);
+                return it.error;
+        }
+        for (i = 0; i < nr; i++) {
+                if (children[i].type != I_DIR) {
+                        in = testfs_get_inode(sb, children[i].inode_nr);
+                        testfs_inode_rdlock(in);
+                        assert((children[i].type == I_NONE) || 
+                               (children[i].type == 
+                                testfs_inode_get_type(in)));
+                        if (testfs_inode_get_type(in) == I_FILE)
+                                testfs_checkfs_inode(sb, cf->i_freemap[thread],
+                                                     cf->b_freemap[thread], 
+                                                     in);
+                        else
+                                children[i].type = I_DIR;
+                        testfs_inode_unlock(in);
+                        testfs_put_inode(in);
+                }
+                if (children[i].type == I_DIR)
+                        walk_add_child(w, node, children[i].inode_nr);
+        }
+        free(children);
         return 0;
 }
 
@@ -283,30 +764,120 @@ int
 cmd_checkfs(struct super_block *sb, struct context *c)
 {
         struct bitmap *i_freemap, *b_freemap;
-        int ret;
+        struct checkfs cf = { sb, };
+        int nr_free_inodes = 0, nr_free_blocks = 0;
+        int i, ret;
 
         if (c->nargs != 1) {
                 return -EINVAL;
         }
+        testfs_tx_start(sb, TX_WRITE);
+        testfs_flush_inodes(sb);
+        testfs_tx_commit(sb, TX_WRITE);
         ret = bitmap_create(BLOCK_SIZE * INODE_FREEMAP_SIZE * BITS_PER_WORD,
                             &i_freemap);
         if (ret < 0)
                 return ret;
         ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD,
                             &b_freemap);
-        if (ret < 0)
+        if (ret < 0) {
+                bitmap_destroy(i_freemap);
                 return ret;
-        testfs_checkfs(sb, i_freemap, b_freemap, 0);
+        }
+        ret = testfs_walk(sb, 0, testfs_checkfs_visit, &cf);
+        for (i = 0; i < WALK_MAX_THREADS; i++) {
+                if (cf.i_freemap[i]) {
+                        bitmap_merge(i_freemap, cf.i_freemap[i]);
+                        bitmap_destroy(cf.i_freemap[i]);
+                }
+                if (cf.b_freemap[i]) {
+                        bitmap_merge(b_freemap, cf.b_freemap[i]);
+                        bitmap_destroy(cf.b_freemap[i]);
+                }
+        }
+        if (ret < 0)
+                goto out;
 
+        for (i = 0; i < NR_GROUPS; i++) {
+                pthread_mutex_lock(&sb->groups[i].lock);
+        }
+        pthread_mutex_lock(&sb->alloc_lock);
         if (!bitmap_equal(sb->inode_freemap, i_freemap)) {
                 printf("inode freemap is not consistent\n");
         }
         if (!bitmap_equal(sb->block_freemap, b_freemap)) {
                 printf("block freemap is not consistent\n");
         }
-        printf("nr of allocated inodes = %d\n",
-               bitmap_nr_allocated(sb->inode_freemap));
+        for (i = 0; i < NR_GROUPS; i++) {
+                struct group *g = &sb->groups[i];
+
+                if (g->nr_free_inodes != INODES_PER_GROUP - 
+                    bitmap_nr_allocated_range(sb->inode_freemap, 
+                            i * INODES_PER_GROUP, INODES_PER_GROUP)) {
+                        printf("free inode count of group %d is not "
+                               "consistent\n", i);
+                }
+                if (g->nr_free_blocks != BLOCKS_PER_GROUP - 
+                    bitmap_nr_allocated_range(sb->block_freemap, 
+                            i * BLOCKS_PER_GROUP, BLOCKS_PER_GROUP)) {
+                        printf("free block count of group %d is not "
+                               "consistent\n", i);
+                }
+                nr_free_inodes += g->nr_free_inodes;
+                nr_free_blocks += g->nr_free_blocks;
+        }
+        if (sb->nr_free_blocks != nr_free_blocks) {
+                printf("free block count is not consistent\n");
+        }
+        printf("nr of allocated inodes = %d\n", NR_INODES - nr_free_inodes);
         printf("nr of allocated blocks = %d\n", 
-               bitmap_nr_allocated(sb->block_freemap));
+               NR_DATA_BLOCKS - nr_free_blocks);
+        pthread_mutex_unlock(&sb->alloc_lock);
+        for (i = NR_GROUPS - 1; i >= 0; i--) {
+                pthread_mutex_unlock(&sb->groups[i].lock);
+        }
+out:
+        bitmap_destroy(i_freemap);
+        bitmap_destroy(b_freemap);
+        return ret;
+}
+
+int
+cmd_statfs(struct super_block *sb, struct context *c)
+{
+        int nr_free_blocks, nr_free_inodes, nr_reserved_blocks;
+        int i;
+
+        if (c->nargs != 1) {
+                return -EINVAL;
+        }
+        testfs_sum_groups(sb, &nr_free_blocks, &nr_free_inodes);
+        pthread_mutex_lock(&sb->alloc_lock);
+        nr_reserved_blocks = sb->nr_reserved_blocks;
+        pthread_mutex_unlock(&sb->alloc_lock);
+        printf("blocks: %d total, %d free, %d reserved\n",
+               NR_DATA_BLOCKS, nr_free_blocks, nr_reserved_blocks);
+        printf("inodes: %d total, %d free\n", NR_INODES, nr_free_inodes);
+        for (i = 0; i < NR_GROUPS; i++) {
+                pthread_mutex_lock(&sb->groups[i].lock);
+                printf("group %d: %d free blocks, %d free inodes\n", i,
+                       sb->groups[i].nr_free_blocks, 
+                       sb->groups[i].nr_free_inodes);
+                pthread_mutex_unlock(&sb->groups[i].lock);
+        }
+        return 0;
+}
+
+int
+cmd_sync(struct super_block *sb, struct context *c)
+{
+        if (c->nargs != 1) {
+                return -EINVAL;
+        }
+        testfs_tx_start(sb, TX_WRITE);
+        testfs_flush_inodes(sb);
+        testfs_tx_commit(sb, TX_WRITE);
+        if (sb->journal)
+                testfs_journal_sync(sb);
         return 0;
 }
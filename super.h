@@ -2,7 +2,39 @@
 #define _SUPER_H
 
 #include <stdio.h>
+#include <pthread.h>
+#include "list.h"
 #include "tx.h"
+#include "bitmap.h"
+
+/* on-disk format versions. version 0 covers the images made before
+ * versioning, with both 32 and 64 byte dinodes. the images with 32 byte
+ * dinodes have half as many inode blocks, and are refused. */
+#define TESTFS_VERSION_DTYPE    1       /* dirents record the inode type */
+#define TESTFS_VERSION_JOURNAL  2       /* metadata journal */
+#define TESTFS_VERSION_CLEAN    3       /* clean flag and free counters */
+#define TESTFS_VERSION          TESTFS_VERSION_CLEAN
+
+#define NR_INODE_FREEMAP_BITS (BLOCK_SIZE * INODE_FREEMAP_SIZE * BITS_PER_WORD)
+#define NR_BLOCK_FREEMAP_BITS (BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD)
+
+/* the inodes and the data blocks are split into allocation groups, each
+ * with a slice of the freemaps. the files of a directory and their blocks
+ * are allocated in the group of the directory. */
+#define NR_GROUPS               8
+/* the inodes that fit in the inode blocks, INODES_PER_BLOCK is in inode.h.
+ * the bits of the freemaps past the inodes and the data blocks are never
+ * allocated. */
+#define NR_INODES               ((int)(NR_INODE_BLOCKS * INODES_PER_BLOCK))
+#define INODES_PER_GROUP        (NR_INODES / NR_GROUPS)
+#define BLOCKS_PER_GROUP        (NR_DATA_BLOCKS / NR_GROUPS)
+#define INODE_GROUP(inode_nr)   ((inode_nr) / INODES_PER_GROUP)
+
+struct group {
+        pthread_mutex_t lock;           /* the slices and the counters */
+        int nr_free_blocks;
+        int nr_free_inodes;
+};
 
 struct dsuper_block {
         int inode_freemap_start;
@@ -11,6 +43,12 @@ struct dsuper_block {
         int inode_blocks_start;
         int data_blocks_start;
         int modification_time;
+        int version;            /* 0 in images older than versioning */
+        int journal_start;      /* TESTFS_VERSION_JOURNAL */
+        int clean;              /* TESTFS_VERSION_CLEAN, unmounted cleanly */
+        int nr_free_blocks;     /* TESTFS_VERSION_CLEAN, valid if clean,
+                                 * checked against the freemaps */
+        int nr_free_inodes;     /* TESTFS_VERSION_CLEAN, valid if clean */
 };
 
 struct super_block {
@@ -18,10 +56,38 @@ struct super_block {
         FILE *dev;
         struct bitmap *inode_freemap;
         struct bitmap *block_freemap;
-        tx_type tx_in_progress;    
 
         // TODO: add your code here
         int *csum_table;
+
+        struct group groups[NR_GROUPS];
+        int nr_free_blocks;             /* not allocated or being allocated */
+        int nr_reserved_blocks;         /* promised to delayed allocations */
+        int delalloc;                   /* delay allocation of file blocks */
+        struct list_head da_inodes;     /* inodes with delayed blocks */
+        struct discard *discard;        /* punch out freed blocks */
+        struct journal *journal;        /* NULL in older images */
+
+        /* caches of this image, see inode.c and dir.c */
+        struct hlist_head *inode_hash;
+        struct hlist_head *dcache_table;
+        struct list_head dcache_lru;
+        int dcache_nr;
+
+        /* locks, taken in this order after any inode locks. the group
+         * locks come between dcache_lock and freemap_lock, in the order
+         * of the groups. */
+        pthread_mutex_t inode_lock;     /* changes to inode_hash, i_count
+                                         * from zero, da_inodes, and the
+                                         * inode blocks */
+        pthread_mutex_t dcache_lock;    /* changes to the dentry cache */
+        pthread_mutex_t freemap_lock;   /* freemap bits and writes of
+                                         * freemap blocks, which groups
+                                         * share */
+        pthread_mutex_t alloc_lock;     /* free and reserved block
+                                         * counters, next_group */
+        pthread_mutex_t csum_lock;      /* csum_table */
+        int next_group;                 /* of the next thread */
 };
 
 struct super_block *testfs_make_super_block(char *file);
@@ -35,10 +101,13 @@ int testfs_init_super_block(const char *file, int corrupt,
 void testfs_write_super_block(struct super_block *sb);
 void testfs_close_super_block(struct super_block *sb);
 
-int testfs_get_inode_freemap(struct super_block *sb);
+int testfs_dir_group(struct super_block *sb);
+int testfs_get_inode_freemap(struct super_block *sb, int group);
 void testfs_put_inode_freemap(struct super_block *sb, int inode_nr);
 
-int testfs_alloc_block(struct super_block *sb, char *block);
+int testfs_alloc_block(struct super_block *sb, int group, char *block);
+int testfs_alloc_blocks(struct super_block *sb, int group, int nr);
+int testfs_reserve_blocks(struct super_block *sb, int nr);
 int testfs_free_block(struct super_block *sb, int block_nr);
 
 #endif /* _SUPER_H */
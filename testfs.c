@@ -1,16 +1,34 @@
 #define _GNU_SOURCE
 #include <stdbool.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "testfs.h"
 #include "super.h"
 #include "inode.h"
 #include "dir.h"
 #include "tx.h"
+#include "discard.h"
+#include "journal.h"
 
 static int cmd_help(struct super_block *, struct context *c);
 static int cmd_quit(struct super_block *, struct context *c);
+static int cmd_image(struct super_block *, struct context *c);
 static bool can_quit = false;
 
+/* images given on the command line. commands run on the current one. */
+struct image {
+        const char *disk;
+        int corrupt;
+        struct super_block *sb;
+        struct context c;
+        pthread_t thread;
+        int ret;
+};
+
+static struct image *images;
+static int nr_images;
+static int cur_image;
+
 #define PROMPT printf("%s", "% ")
 
 static struct {
@@ -30,7 +48,12 @@ static struct {
         { "mkdir",      cmd_mkdir,      2, },
         { "cat",        cmd_cat,        MAX_ARGS, },
         { "write",      cmd_write,      2, },
+        { "pwrite",     cmd_pwrite,     3, },
+        { "fallocate",  cmd_fallocate,  4, },
         { "checkfs",    cmd_checkfs,    1, },
+        { "sync",       cmd_sync,       1, },
+        { "statfs",     cmd_statfs,     1, },
+        { "image",      cmd_image,      2, },
         { "quit",    	cmd_quit,       1, },
         { NULL,         NULL}
 };
@@ -54,6 +77,25 @@ cmd_quit(struct super_block *sb, struct context *c)
         can_quit = true;
         return 0;
 }
+
+/* lists the open images, or switches to image n */
+static int
+cmd_image(struct super_block *sb, struct context *c)
+{
+        int i;
+
+        if (c->nargs == 1) {
+                for (i = 0; i < nr_images; i++) {
+                        printf("%c %d %s\n", i == cur_image ? '*' : ' ', i,
+                               images[i].disk);
+                }
+                return 0;
+        }
+        if (testfs_parse_nr(c->cmd[1], &i) < 0 || i >= nr_images)
+                return -EINVAL;
+        cur_image = i;
+        return 0;
+}
 	
 static void
 handle_command(struct super_block *sb, struct context *c, char * name,
@@ -95,23 +137,32 @@ handle_command(struct super_block *sb, struct context *c, char * name,
 static void 
 usage(const char * progname)
 {
-    fprintf(stderr, "Usage: %s [-ch][--help] rawfile\n", progname);
+    fprintf(stderr, "Usage: %s [-cdDh][-g ms][-j ordered|data][--help] rawfile...\n", progname);
     exit(1);
 }
 
 struct args
 {
-    const char * disk;  // name of disk
+    char * const * disks; // names of disks
+    int nr_disks;
     int corrupt;        // to corrupt or not
+    int delalloc;       // delay block allocation of file writes
+    int discard;        // punch freed blocks out of the disk file
+    int commit_interval; // ms a transaction may wait for the journal, or -1
+    int journal_mode;   // how file data is journaled, or -1
 };
 
 static struct args *
 parse_arguments(int argc, char * const argv[])
 {
-    static struct args args = { 0 };
+    static struct args args = { .commit_interval = -1, .journal_mode = -1 };
     static struct option long_options[] =
     {
         {"corrupt", no_argument,       0, 'c'},
+        {"delalloc", no_argument,      0, 'd'},
+        {"discard", no_argument,       0, 'D'},
+        {"commit-interval", required_argument, 0, 'g'},
+        {"journal", required_argument, 0, 'j'},
         {"help",    no_argument,       0, 'h'},
         {0, 0, 0, 0},
     };
@@ -120,7 +171,7 @@ parse_arguments(int argc, char * const argv[])
     while (running)
     {
         int option_index = 0;
-        int c = getopt_long (argc, argv, "ch", long_options, &option_index);
+        int c = getopt_long (argc, argv, "cdDg:j:h", long_options, &option_index);
         switch (c)
         {
         case -1:
@@ -131,6 +182,24 @@ parse_arguments(int argc, char * const argv[])
         case 'c':
             args.corrupt = 1;
             break;
+        case 'd':
+            args.delalloc = 1;
+            break;
+        case 'D':
+            args.discard = 1;
+            break;
+        case 'g':
+            if (testfs_parse_nr(optarg, &args.commit_interval) < 0)
+                usage(argv[0]);
+            break;
+        case 'j':
+            if (strcmp(optarg, "ordered") == 0)
+                args.journal_mode = JOURNAL_MODE_ORDERED;
+            else if (strcmp(optarg, "data") == 0)
+                args.journal_mode = JOURNAL_MODE_DATA;
+            else
+                usage(argv[0]);
+            break;
         case 'h':
             usage(argv[0]);
             break;
@@ -142,13 +211,26 @@ parse_arguments(int argc, char * const argv[])
         }
     }
     
-    if ( argc - optind != 1 )
+    if ( argc - optind < 1 )
         usage(argv[0]);
         
-    args.disk = argv[optind];
+    args.disks = argv + optind;
+    args.nr_disks = argc - optind;
     return &args;
 }
 
+/* mounts one image, on its own thread so that journal replays overlap */
+static void *
+open_image(void *arg)
+{
+        struct image *im = arg;
+
+        im->ret = testfs_init_super_block(im->disk, im->corrupt, &im->sb);
+        if (im->ret == 0)
+                im->c.cur_dir = testfs_get_inode(im->sb, 0); /* root dir */
+        return NULL;
+}
+
 int
 main(int argc, char * const argv[])
 {
@@ -156,24 +238,51 @@ main(int argc, char * const argv[])
         char *line = NULL;
         size_t line_size = 0;
         ssize_t nr;
-        int ret;
-        struct context c;
+        int i, ret;
         struct args * args = parse_arguments(argc, argv);
         
-        ret = testfs_init_super_block(args->disk,args-> corrupt, &sb);
-        if (ret) {
-            EXIT("testfs_init_super_block");
+        nr_images = args->nr_disks;
+        if ((images = calloc(nr_images, sizeof(struct image))) == NULL) {
+            EXIT("calloc");
+        }
+        for (i = 0; i < nr_images; i++) {
+            images[i].disk = args->disks[i];
+            images[i].corrupt = args->corrupt;
+            if (pthread_create(&images[i].thread, NULL, open_image,
+                               &images[i]) != 0) {
+                EXIT("pthread_create");
+            }
+        }
+        for (i = 0; i < nr_images; i++) {
+            pthread_join(images[i].thread, NULL);
+            if (images[i].ret) {
+                errno = -images[i].ret;
+                EXIT(images[i].disk);
+            }
+        }
+        for (i = 0; i < nr_images; i++) {
+            sb = images[i].sb;
+            sb->delalloc = args->delalloc;
+            if (sb->journal && args->commit_interval >= 0)
+                testfs_journal_set_commit_interval(sb, 
+                                                   args->commit_interval);
+            if (sb->journal && args->journal_mode >= 0)
+                testfs_journal_set_mode(sb, args->journal_mode);
+            if (args->discard && (ret = testfs_discard_init(sb)) < 0) {
+                errno = -ret;
+                EXIT("testfs_discard_init");
+            }
         }
-        c.cur_dir = testfs_get_inode(sb, 0); /* root dir */
         for (;	
             PROMPT, 
             (nr = getline(&line, &line_size, stdin)) != EOF; ) {
             char * name; 
             char * args;
+            struct image *im = &images[cur_image];
 
             name = strtok(line, " \t\n");
             args = strtok(NULL, "\n");
-            handle_command(sb, &c, name, args);
+            handle_command(im->sb, &im->c, name, args);
             
             if ( can_quit ) {
                 break;
@@ -181,7 +290,10 @@ main(int argc, char * const argv[])
         }
         
         free(line);
-        testfs_put_inode(c.cur_dir);
-        testfs_close_super_block(sb);
+        for (i = 0; i < nr_images; i++) {
+            testfs_put_inode(images[i].c.cur_dir);
+            testfs_close_super_block(images[i].sb);
+        }
+        free(images);
         return 0;
 }
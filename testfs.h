@@ -10,8 +10,9 @@
 #define INODE_FREEMAP_SIZE  1           /* start 0x0040 */
 #define BLOCK_FREEMAP_SIZE  2           /* start 0x0080 */
 #define CSUM_TABLE_SIZE    60           /* start 0x0100 */
-#define NR_INODE_BLOCKS   128           /* start 0x1000 */
-#define NR_DATA_BLOCKS    512           /* start 0x3000 */
+#define NR_INODE_BLOCKS   256           /* start 0x1000 */
+#define JOURNAL_SIZE      256           /* start 0x5000 */
+#define NR_DATA_BLOCKS    512           /* start 0x9000 */
 
 struct super_block;
 struct inode;
@@ -35,7 +36,12 @@ int cmd_mkdir(struct super_block *, struct context *c);
 
 int cmd_cat(struct super_block *, struct context *c);
 int cmd_write(struct super_block *, struct context *c);
+int cmd_pwrite(struct super_block *, struct context *c);
+int cmd_fallocate(struct super_block *, struct context *c);
+int testfs_parse_nr(const char *str, int *nrp);
 
 int cmd_checkfs(struct super_block *, struct context *c);
+int cmd_sync(struct super_block *, struct context *c);
+int cmd_statfs(struct super_block *, struct context *c);
 
 #endif /* _TESTFS_H */
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include "super.h"
 #include "tx.h"
+#include "journal.h"
 
 char *tx_type_array[] = {"TX_NONE",
                          "TX_WRITE",
@@ -8,16 +9,38 @@ char *tx_type_array[] = {"TX_NONE",
                          "TX_RM",
                          "TX_UMOUNT"};
 
+/* each thread runs at most one transaction at a time. the transactions of
+ * all threads are committed to the journal together, when the last one
+ * ends. */
+static __thread tx_type tx_current = TX_NONE;
+static __thread struct super_block *tx_sb = NULL;
+
+/* starts a transaction of the calling thread. it must be started before
+ * any inode is locked, since it may wait for the journal to commit the
+ * transactions of other threads. */
 void
 testfs_tx_start(struct super_block *sb, tx_type type)
 {
-        assert(sb->tx_in_progress == TX_NONE);
-        sb->tx_in_progress = type;
+        assert(tx_current == TX_NONE);
+        if (sb->journal)
+                testfs_journal_start(sb);
+        tx_current = type;
+        tx_sb = sb;
 }
 
 void
 testfs_tx_commit(struct super_block *sb, tx_type type)
 {
-        assert(sb->tx_in_progress == type);
-        sb->tx_in_progress = TX_NONE;
+        assert(tx_current == type && tx_sb == sb);
+        tx_current = TX_NONE;
+        tx_sb = NULL;
+        if (sb->journal)
+                testfs_journal_commit(sb);
+}
+
+/* returns the transaction that the calling thread runs on sb */
+tx_type
+testfs_tx_in_progress(struct super_block *sb)
+{
+        return tx_sb == sb ? tx_current : TX_NONE;
 }
@@ -6,5 +6,6 @@ struct super_block;
 typedef enum {TX_NONE, TX_WRITE, TX_CREATE, TX_RM, TX_UMOUNT } tx_type;
 void testfs_tx_start(struct super_block *sb, tx_type type);
 void testfs_tx_commit(struct super_block *sb, tx_type type);
+tx_type testfs_tx_in_progress(struct super_block *sb);
 
 #endif /* _TX_H */
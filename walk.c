@@ -0,0 +1,344 @@
+#include <pthread.h>
+#include <assert.h>
+#include "testfs.h"
+#include "super.h"
+#include "inode.h"
+#include "walk.h"
+
+/* a directory tree is walked by a pool of threads. each thread has a deque
+ * of directories to visit. it takes directories from the bottom of its own
+ * deque, which keeps its walk depth first, and steals from the top of the
+ * other deques when its own is empty.
+ *
+ * a visit writes its output to its node. a child node remembers where in
+ * the output of its parent it was queued, and the tree of nodes is printed
+ * in that order after the walk, so the output does not depend on the
+ * order of the visits.
+ *
+ * visits run in parallel, and lock the inodes they read. the inodes of
+ * queued directories are prefetched. */
+
+struct walk_node {
+        int inode_nr;
+        int thread;                     /* thread that visits the node */
+        FILE *out;                      /* open until the node is visited */
+        char *out_buf;
+        size_t out_len;
+        long at;                        /* offset in output of parent */
+        struct walk_node *children;     /* in the order they were queued */
+        struct walk_node **last;
+        struct walk_node *next;
+};
+
+struct walk_deque {
+        pthread_mutex_t lock;
+        struct walk_node **nodes;
+        int head;                       /* next node to steal */
+        int tail;                       /* next free slot */
+        int size;
+};
+
+struct walk {
+        struct super_block *sb;
+        walk_visit_t visit;
+        void *arg;
+        int ret;                        /* first error */
+        int nr_threads;
+        pthread_mutex_t lock;           /* ret */
+        pthread_mutex_t pool_lock;      /* counters, and pushes to deques */
+        pthread_cond_t pool_cond;
+        int nr_queued;                  /* nodes in the deques */
+        int nr_pending;                 /* nodes not visited yet */
+        struct walk_deque deques[WALK_MAX_THREADS];
+};
+
+struct walk_thread {
+        pthread_t thread;
+        struct walk *w;
+        int nr;
+};
+
+static struct walk_node *
+walk_node_create(int inode_nr)
+{
+        struct walk_node *node = calloc(1, sizeof(struct walk_node));
+
+        if (!node)
+                return NULL;
+        node->inode_nr = inode_nr;
+        node->out = open_memstream(&node->out_buf, &node->out_len);
+        if (!node->out) {
+                free(node);
+                return NULL;
+        }
+        node->last = &node->children;
+        return node;
+}
+
+static void
+walk_node_free(struct walk_node *node)
+{
+        struct walk_node *child, *next;
+
+        for (child = node->children; child; child = next) {
+                next = child->next;
+                walk_node_free(child);
+        }
+        if (node->out)
+                fclose(node->out);
+        free(node->out_buf);
+        free(node);
+}
+
+/* prints the output of node with the output of its children in place */
+static void
+walk_node_print(struct walk_node *node)
+{
+        struct walk_node *child;
+        long pos = 0;
+
+        assert(node->out == NULL);
+        for (child = node->children; child; child = child->next) {
+                fwrite(node->out_buf + pos, 1, child->at - pos, stdout);
+                walk_node_print(child);
+                pos = child->at;
+        }
+        fwrite(node->out_buf + pos, 1, node->out_len - pos, stdout);
+}
+
+int
+walk_node_inode_nr(struct walk_node *node)
+{
+        return node->inode_nr;
+}
+
+FILE *
+walk_node_out(struct walk_node *node)
+{
+        return node->out;
+}
+
+/* returns negative value on error */
+static int
+walk_deque_push(struct walk_deque *dq, struct walk_node *node)
+{
+        int ret = 0;
+
+        pthread_mutex_lock(&dq->lock);
+        if (dq->tail == dq->size && dq->head > 0) {
+                memmove(dq->nodes, dq->nodes + dq->head,
+                        (dq->tail - dq->head) * sizeof(struct walk_node *));
+                dq->tail -= dq->head;
+                dq->head = 0;
+        } else if (dq->tail == dq->size) {
+                int size = dq->size ? dq->size * 2 : 16;
+                struct walk_node **nodes;
+
+                nodes = realloc(dq->nodes, size * sizeof(struct walk_node *));
+                if (!nodes) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                dq->nodes = nodes;
+                dq->size = size;
+        }
+        dq->nodes[dq->tail++] = node;
+out:
+        pthread_mutex_unlock(&dq->lock);
+        return ret;
+}
+
+/* takes the newest node of the deque if steal is 0, the oldest otherwise */
+static struct walk_node *
+walk_deque_take(struct walk_deque *dq, int steal)
+{
+        struct walk_node *node = NULL;
+
+        pthread_mutex_lock(&dq->lock);
+        if (dq->head < dq->tail)
+                node = steal ? dq->nodes[dq->head++] : dq->nodes[--dq->tail];
+        if (dq->head == dq->tail)
+                dq->head = dq->tail = 0;
+        pthread_mutex_unlock(&dq->lock);
+        return node;
+}
+
+/* returns negative value on error. the node is pushed under pool_lock,
+ * so that it is counted before another thread can take it. pool_lock is
+ * taken before the deque locks. */
+static int
+walk_queue(struct walk *w, int thread, struct walk_node *node)
+{
+        int ret;
+
+        pthread_mutex_lock(&w->pool_lock);
+        ret = walk_deque_push(&w->deques[thread], node);
+        if (ret == 0) {
+                w->nr_queued++;
+                w->nr_pending++;
+                pthread_cond_signal(&w->pool_cond);
+        }
+        pthread_mutex_unlock(&w->pool_lock);
+        return ret;
+}
+
+/* returns the next node to visit, or NULL when the walk is done */
+static struct walk_node *
+walk_take(struct walk *w, int thread)
+{
+        struct walk_node *node;
+        int i;
+
+        for (;;) {
+                node = walk_deque_take(&w->deques[thread], 0);
+                for (i = 1; !node && i < w->nr_threads; i++) {
+                        node = walk_deque_take(
+                                &w->deques[(thread + i) % w->nr_threads], 1);
+                }
+                pthread_mutex_lock(&w->pool_lock);
+                if (node) {
+                        w->nr_queued--;
+                        pthread_mutex_unlock(&w->pool_lock);
+                        return node;
+                }
+                while (w->nr_queued == 0 && w->nr_pending > 0)
+                        pthread_cond_wait(&w->pool_cond, &w->pool_lock);
+                if (w->nr_pending == 0) {
+                        pthread_mutex_unlock(&w->pool_lock);
+                        return NULL;
+                }
+                pthread_mutex_unlock(&w->pool_lock);
+        }
+}
+
+/* records the first error of the walk */
+static void
+walk_fail(struct walk *w, int ret)
+{
+        pthread_mutex_lock(&w->lock);
+        if (w->ret == 0)
+                w->ret = ret;
+        pthread_mutex_unlock(&w->lock);
+}
+
+static int
+walk_failed(struct walk *w)
+{
+        int ret;
+
+        pthread_mutex_lock(&w->lock);
+        ret = w->ret;
+        pthread_mutex_unlock(&w->lock);
+        return ret;
+}
+
+static void *
+walk_thread(void *arg)
+{
+        struct walk_thread *t = arg;
+        struct walk *w = t->w;
+        struct walk_node *node;
+
+        while ((node = walk_take(w, t->nr))) {
+                node->thread = t->nr;
+                if (walk_failed(w) == 0) {
+                        int ret = w->visit(w, node, t->nr, w->arg);
+                        if (ret < 0)
+                                walk_fail(w, ret);
+                }
+                fclose(node->out);
+                node->out = NULL;
+
+                pthread_mutex_lock(&w->pool_lock);
+                if (--w->nr_pending == 0)
+                        pthread_cond_broadcast(&w->pool_cond);
+                pthread_mutex_unlock(&w->pool_lock);
+        }
+        return NULL;
+}
+
+/* queues the subdirectory inode_nr of parent, called from a visit */
+void
+walk_add_child(struct walk *w, struct walk_node *parent, int inode_nr)
+{
+        struct walk_node *child = walk_node_create(inode_nr);
+
+        if (!child) {
+                walk_fail(w, -ENOMEM);
+                return;
+        }
+        child->at = ftell(parent->out);
+        *parent->last = child;
+        parent->last = &child->next;
+        testfs_prefetch_inode(w->sb, inode_nr);
+        if (walk_queue(w, parent->thread, child) < 0) {
+                walk_fail(w, -ENOMEM);
+                /* never visited */
+                fclose(child->out);
+                child->out = NULL;
+        }
+}
+
+/* walks the directory tree at inode_nr, calling visit for each directory,
+ * and prints the output of the visits.
+ * returns negative value on error. */
+int
+testfs_walk(struct super_block *sb, int inode_nr, walk_visit_t visit,
+            void *arg)
+{
+        struct walk w;
+        struct walk_thread threads[WALK_MAX_THREADS];
+        struct walk_node *root;
+        long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int i, ret;
+
+        w.sb = sb;
+        w.visit = visit;
+        w.arg = arg;
+        w.ret = 0;
+        w.nr_threads = MAX(1, MIN(nr_cpus, WALK_MAX_THREADS));
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_mutex_init(&w.pool_lock, NULL);
+        pthread_cond_init(&w.pool_cond, NULL);
+        w.nr_queued = 0;
+        w.nr_pending = 0;
+        for (i = 0; i < w.nr_threads; i++) {
+                pthread_mutex_init(&w.deques[i].lock, NULL);
+                w.deques[i].nodes = NULL;
+                w.deques[i].head = w.deques[i].tail = w.deques[i].size = 0;
+        }
+        if ((root = walk_node_create(inode_nr)) == NULL) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        if ((ret = walk_queue(&w, 0, root)) < 0)
+                goto out;
+        /* the caller is thread 0. if a helper cannot be started, its deque
+         * stays empty and the others do its share. */
+        for (i = 0; i < w.nr_threads; i++) {
+                threads[i].w = &w;
+                threads[i].nr = i;
+        }
+        for (i = 1; i < w.nr_threads; i++) {
+                if (pthread_create(&threads[i].thread, NULL, walk_thread,
+                                   &threads[i]) != 0)
+                        break;
+        }
+        walk_thread(&threads[0]);
+        while (--i > 0)
+                pthread_join(threads[i].thread, NULL);
+        ret = w.ret;
+        if (ret == 0)
+                walk_node_print(root);
+out:
+        if (root)
+                walk_node_free(root);
+        for (i = 0; i < w.nr_threads; i++) {
+                pthread_mutex_destroy(&w.deques[i].lock);
+                free(w.deques[i].nodes);
+        }
+        pthread_cond_destroy(&w.pool_cond);
+        pthread_mutex_destroy(&w.pool_lock);
+        pthread_mutex_destroy(&w.lock);
+        return ret;
+}
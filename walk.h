@@ -0,0 +1,25 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+#include <stdio.h>
+
+#define WALK_MAX_THREADS 8
+
+struct super_block;
+struct walk;
+struct walk_node;
+
+/* visits the directory of node, on one of the walk threads. thread is the
+ * index of that thread, below WALK_MAX_THREADS. subdirectories to visit
+ * are queued with walk_add_child.
+ * returns negative value on error, which stops the walk. */
+typedef int (*walk_visit_t)(struct walk *w, struct walk_node *node,
+                            int thread, void *arg);
+
+int testfs_walk(struct super_block *sb, int inode_nr, walk_visit_t visit,
+                void *arg);
+void walk_add_child(struct walk *w, struct walk_node *parent, int inode_nr);
+int walk_node_inode_nr(struct walk_node *node);
+FILE *walk_node_out(struct walk_node *node);
+
+#endif /* _WALK_H */